@@ -0,0 +1,96 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+BranchlessCompare.h - rewrites of the comparison functions from
+CompareAsInt.h which give identical results but which evaluate every
+condition and combine them with non-short-circuiting operators and masks, so
+that the compiler has no reason to generate data-dependent branches.
+
+Whether this is a win depends on the data - see CompareBench.cpp.
+
+Requires C++20.
+*/
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#include <bit>
+
+inline bool AlmostEqualRelativeBranchless(float A, float B,
+                                          float maxRelativeError) {
+  // If A == B == 0 this divides zero by zero, but the NAN is ignored.
+  float relativeError = fabsf((A - B) / B);
+  return (A == B) | (relativeError <= maxRelativeError);
+}
+
+inline bool AlmostEqualRelative2Branchless(float A, float B,
+                                           float maxRelativeError) {
+  float largest = fabsf(B) > fabsf(A) ? B : A;
+  float relativeError = fabsf((A - B) / largest);
+  return (A == B) | (relativeError <= maxRelativeError);
+}
+
+inline bool AlmostEqualRelativeOrAbsoluteBranchless(float A, float B,
+                                                    float maxRelativeError,
+                                                    float maxAbsoluteError) {
+  float largest = fabsf(B) > fabsf(A) ? B : A;
+  float relativeError = fabsf((A - B) / largest);
+  return (fabsf(A - B) < maxAbsoluteError) |
+         (relativeError <= maxRelativeError);
+}
+
+// Integer difference of two representations with the same wrap-around as
+// abs(*(int *)&A - *(int *)&B), so abs(INT_MIN) stays negative as it does in
+// the originals, but without relying on signed overflow.
+inline int32_t WrappedAbsDiff(uint32_t a, uint32_t b) {
+  uint32_t diff = a - b;
+  uint32_t mask = uint32_t(int32_t(diff) >> 31);
+  return int32_t((diff ^ mask) - mask);
+}
+
+inline bool AlmostEqualUlpsBranchless(float A, float B, int maxUlps) {
+  uint32_t aInt = std::bit_cast<uint32_t>(A);
+  uint32_t bInt = std::bit_cast<uint32_t>(B);
+  return (A == B) | (WrappedAbsDiff(aInt, bInt) <= maxUlps);
+}
+
+// The lexicographic ordering from AlmostEqual2sComplement, done with a mask
+// instead of if (aInt < 0) aInt = 0x80000000 - aInt.
+inline uint32_t TwosComplementOrdered(uint32_t a) {
+  uint32_t mask = uint32_t(int32_t(a) >> 31);
+  return (a ^ (mask & 0x7FFFFFFF)) - mask;
+}
+
+inline bool AlmostEqual2sComplementBranchless(float A, float B, int maxUlps) {
+  uint32_t aInt = TwosComplementOrdered(std::bit_cast<uint32_t>(A));
+  uint32_t bInt = TwosComplementOrdered(std::bit_cast<uint32_t>(B));
+  return WrappedAbsDiff(aInt, bInt) <= maxUlps;
+}
+
+// Every special case of AlmostEqualUlpsFinal - infinities, NANs and differing
+// signs - falls back to A == B, so they can all be folded into one flag.
+inline bool AlmostEqualUlpsFinalBranchless(float A, float B, int maxUlps) {
+  uint32_t aInt = std::bit_cast<uint32_t>(A);
+  uint32_t bInt = std::bit_cast<uint32_t>(B);
+  const uint32_t kInfBits = 0x7F800000;
+  bool special = ((aInt & 0x7FFFFFFF) >= kInfBits) |
+                 ((bInt & 0x7FFFFFFF) >= kInfBits) | bool((aInt ^ bInt) >> 31);
+  bool close = WrappedAbsDiff(aInt, bInt) <= maxUlps;
+  return (special & (A == B)) | (!special & close);
+}
@@ -0,0 +1,402 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+BulkCompare.cpp - SIMD implementations of AlmostEqualUlpsFinal for arrays.
+
+The scalar function has three early-outs (infinity, NAN, sign) which
+mispredict badly on mixed data. The kernels here evaluate all of the checks
+for every lane and then select the result with masks, so there are no
+data-dependent branches. Each lane produces a ULP distance: the integer
+difference for same-signed finite numbers, zero for the special cases that
+AlmostEqualUlpsFinal treats as equal (identical infinities, +0 and -0) and
+kUlpsIncomparable for everything else. The scalar tails use the same rules
+via ulps::UlpDistance from FloatUlps.h.
+*/
+
+#include "BulkCompare.h"
+
+#include <assert.h>
+
+#include "FloatUlps.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define BULK_COMPARE_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// VC++ lets any function use any intrinsic, but gcc and clang need to be told
+// which functions are allowed to use AVX2 and AVX-512 instructions.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+namespace {
+
+// Bit patterns shared by all of the kernels.
+const int32_t kAbsMask = 0x7FFFFFFF;
+const int32_t kInfAsInt = 0x7F800000;
+const int32_t kSignBit = INT32_MIN;
+
+// The counters in the SIMD kernels are 32-bit so AlmostEqualUlpsBulk feeds
+// them at most this many elements at a time.
+const size_t kMaxChunk = size_t(1) << 30;
+
+BulkCompareResult CompareScalar(const float* A, const float* B, size_t count,
+                                uint32_t maxUlps) {
+  BulkCompareResult result = {0, count, 0};
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t dist = UlpDistanceFinal(A[i], B[i]);
+    if (dist <= maxUlps)
+      ++result.matchCount;
+    else if (result.firstMismatch == count)
+      result.firstMismatch = i;
+    if (dist > result.maxUlps)
+      result.maxUlps = dist;
+  }
+  return result;
+}
+
+static_assert(kUlpsIncomparable == ulps::kIncomparable<float>,
+              "Incomparable distances must match FloatUlps.h.");
+
+// Folds the results of a scalar tail into the results of a SIMD body that
+// covered the first offset elements.
+void MergeTail(BulkCompareResult& result, const BulkCompareResult& tail,
+               size_t offset, size_t count) {
+  result.matchCount += tail.matchCount;
+  if (result.firstMismatch == count && tail.firstMismatch != count - offset)
+    result.firstMismatch = offset + tail.firstMismatch;
+  if (tail.maxUlps > result.maxUlps)
+    result.maxUlps = tail.maxUlps;
+}
+
+#ifdef BULK_COMPARE_X86
+
+int PopCount(unsigned mask) {
+  // Only used on 4-bit and 8-bit masks so a table is plenty.
+  static const unsigned char kBits[16] = {0, 1, 1, 2, 1, 2, 2, 3,
+                                          1, 2, 2, 3, 2, 3, 3, 4};
+  return kBits[mask & 15] + kBits[(mask >> 4) & 15];
+}
+
+int LowestSetBit(unsigned mask) {
+  int index = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    ++index;
+  }
+  return index;
+}
+
+// SSE2 is missing unsigned compares, unsigned max, and abs, so they are
+// synthesized by flipping the sign bit and by using xor/subtract.
+BulkCompareResult CompareSSE2(const float* A, const float* B, size_t count,
+                              uint32_t maxUlps) {
+  const __m128i absMask = _mm_set1_epi32(kAbsMask);
+  const __m128i infMinusOne = _mm_set1_epi32(kInfAsInt - 1);
+  const __m128i infPlusOne = _mm_set1_epi32(kInfAsInt + 1);
+  const __m128i signBit = _mm_set1_epi32(kSignBit);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i allOnes = _mm_cmpeq_epi32(zero, zero);
+  const __m128i biasedMaxUlps = _mm_set1_epi32(int32_t(maxUlps ^ kSignBit));
+  __m128i biasedMaxDist = signBit;
+  size_t mismatchCount = 0;
+  size_t firstMismatch = count;
+
+  const size_t vectorCount = count & ~size_t(3);
+  for (size_t i = 0; i < vectorCount; i += 4) {
+    __m128i a = _mm_castps_si128(_mm_loadu_ps(A + i));
+    __m128i b = _mm_castps_si128(_mm_loadu_ps(B + i));
+    __m128i aAbs = _mm_and_si128(a, absMask);
+    __m128i bAbs = _mm_and_si128(b, absMask);
+    // Infinities, NANs, and opposite signs all need special handling.
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpgt_epi32(aAbs, infMinusOne),
+                     _mm_cmpgt_epi32(bAbs, infMinusOne)),
+        _mm_srai_epi32(_mm_xor_si128(a, b), 31));
+    // Special cases are equal if they are identical (and not NANs) or if
+    // they are both zeroes.
+    __m128i specialEqual = _mm_or_si128(
+        _mm_and_si128(_mm_cmpeq_epi32(a, b), _mm_cmpgt_epi32(infPlusOne, aAbs)),
+        _mm_cmpeq_epi32(_mm_or_si128(aAbs, bAbs), zero));
+    __m128i diff = _mm_sub_epi32(a, b);
+    __m128i diffSign = _mm_srai_epi32(diff, 31);
+    __m128i absDiff = _mm_sub_epi32(_mm_xor_si128(diff, diffSign), diffSign);
+    __m128i dist = _mm_or_si128(
+        _mm_and_si128(special, _mm_xor_si128(specialEqual, allOnes)),
+        _mm_andnot_si128(special, absDiff));
+
+    __m128i biasedDist = _mm_xor_si128(dist, signBit);
+    __m128i mismatch = _mm_cmpgt_epi32(biasedDist, biasedMaxUlps);
+    __m128i larger = _mm_cmpgt_epi32(biasedDist, biasedMaxDist);
+    biasedMaxDist = _mm_or_si128(_mm_and_si128(larger, biasedDist),
+                                 _mm_andnot_si128(larger, biasedMaxDist));
+
+    unsigned mask = unsigned(_mm_movemask_ps(_mm_castsi128_ps(mismatch)));
+    mismatchCount += PopCount(mask);
+    if (mask && firstMismatch == count)
+      firstMismatch = i + LowestSetBit(mask);
+  }
+
+  uint32_t lanes[4];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), biasedMaxDist);
+  uint32_t maxDist = 0;
+  for (uint32_t lane : lanes) {
+    lane ^= uint32_t(kSignBit);
+    if (lane > maxDist)
+      maxDist = lane;
+  }
+
+  BulkCompareResult result = {vectorCount - mismatchCount, firstMismatch,
+                              maxDist};
+  BulkCompareResult tail = CompareScalar(A + vectorCount, B + vectorCount,
+                                         count - vectorCount, maxUlps);
+  MergeTail(result, tail, vectorCount, count);
+  return result;
+}
+
+TARGET_AVX2
+BulkCompareResult CompareAVX2(const float* A, const float* B, size_t count,
+                              uint32_t maxUlps) {
+  const __m256i absMask = _mm256_set1_epi32(kAbsMask);
+  const __m256i infMinusOne = _mm256_set1_epi32(kInfAsInt - 1);
+  const __m256i infPlusOne = _mm256_set1_epi32(kInfAsInt + 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i allOnes = _mm256_cmpeq_epi32(zero, zero);
+  const __m256i maxUlpsV = _mm256_set1_epi32(int32_t(maxUlps));
+  __m256i maxDist = zero;
+  size_t mismatchCount = 0;
+  size_t firstMismatch = count;
+
+  const size_t vectorCount = count & ~size_t(7);
+  for (size_t i = 0; i < vectorCount; i += 8) {
+    __m256i a = _mm256_castps_si256(_mm256_loadu_ps(A + i));
+    __m256i b = _mm256_castps_si256(_mm256_loadu_ps(B + i));
+    __m256i aAbs = _mm256_and_si256(a, absMask);
+    __m256i bAbs = _mm256_and_si256(b, absMask);
+    __m256i special = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpgt_epi32(aAbs, infMinusOne),
+                        _mm256_cmpgt_epi32(bAbs, infMinusOne)),
+        _mm256_srai_epi32(_mm256_xor_si256(a, b), 31));
+    __m256i specialEqual = _mm256_or_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi32(a, b),
+                         _mm256_cmpgt_epi32(infPlusOne, aAbs)),
+        _mm256_cmpeq_epi32(_mm256_or_si256(aAbs, bAbs), zero));
+    __m256i absDiff = _mm256_abs_epi32(_mm256_sub_epi32(a, b));
+    __m256i dist = _mm256_blendv_epi8(
+        absDiff, _mm256_xor_si256(specialEqual, allOnes), special);
+
+    // dist > maxUlps, unsigned, is the same as max(dist, maxUlps) != maxUlps.
+    __m256i mismatch = _mm256_xor_si256(
+        _mm256_cmpeq_epi32(_mm256_max_epu32(dist, maxUlpsV), maxUlpsV),
+        allOnes);
+    maxDist = _mm256_max_epu32(maxDist, dist);
+
+    unsigned mask =
+        unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(mismatch)));
+    mismatchCount += PopCount(mask);
+    if (mask && firstMismatch == count)
+      firstMismatch = i + LowestSetBit(mask);
+  }
+
+  __m128i max4 = _mm_max_epu32(_mm256_castsi256_si128(maxDist),
+                               _mm256_extracti128_si256(maxDist, 1));
+  max4 = _mm_max_epu32(max4, _mm_shuffle_epi32(max4, _MM_SHUFFLE(1, 0, 3, 2)));
+  max4 = _mm_max_epu32(max4, _mm_shuffle_epi32(max4, _MM_SHUFFLE(2, 3, 0, 1)));
+
+  BulkCompareResult result = {vectorCount - mismatchCount, firstMismatch,
+                              uint32_t(_mm_cvtsi128_si32(max4))};
+  BulkCompareResult tail = CompareScalar(A + vectorCount, B + vectorCount,
+                                         count - vectorCount, maxUlps);
+  MergeTail(result, tail, vectorCount, count);
+  return result;
+}
+
+// AVX-512 has mask registers, unsigned compares and masked loads so it needs
+// no scalar tail - the inactive lanes load as 0.0 versus 0.0, which match.
+TARGET_AVX512
+BulkCompareResult CompareAVX512(const float* A, const float* B, size_t count,
+                                uint32_t maxUlps) {
+  const __m512i absMask = _mm512_set1_epi32(kAbsMask);
+  const __m512i inf = _mm512_set1_epi32(kInfAsInt);
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i maxUlpsV = _mm512_set1_epi32(int32_t(maxUlps));
+  __m512i maxDist = zero;
+  size_t mismatchCount = 0;
+  size_t firstMismatch = count;
+
+  for (size_t i = 0; i < count; i += 16) {
+    __mmask16 active = 0xFFFF;
+    if (count - i < 16)
+      active = __mmask16((1u << (count - i)) - 1);
+    __m512i a = _mm512_maskz_loadu_epi32(active, A + i);
+    __m512i b = _mm512_maskz_loadu_epi32(active, B + i);
+    __m512i aAbs = _mm512_and_si512(a, absMask);
+    __m512i bAbs = _mm512_and_si512(b, absMask);
+    __mmask16 special = _mm512_cmpge_epi32_mask(aAbs, inf) |
+                        _mm512_cmpge_epi32_mask(bAbs, inf) |
+                        _mm512_cmplt_epi32_mask(_mm512_xor_si512(a, b), zero);
+    __mmask16 specialEqual =
+        (_mm512_cmpeq_epi32_mask(a, b) & _mm512_cmple_epi32_mask(aAbs, inf)) |
+        _mm512_cmpeq_epi32_mask(_mm512_or_si512(aAbs, bAbs), zero);
+    __m512i absDiff = _mm512_abs_epi32(_mm512_sub_epi32(a, b));
+    // Special lanes become 0 or all ones, the rest keep their difference.
+    __m512i dist = _mm512_mask_mov_epi32(
+        absDiff, special,
+        _mm512_maskz_set1_epi32(__mmask16(~specialEqual), -1));
+
+    unsigned mask = _mm512_cmpgt_epu32_mask(dist, maxUlpsV);
+    maxDist = _mm512_max_epu32(maxDist, dist);
+    mismatchCount += PopCount(mask) + PopCount(mask >> 8);
+    if (mask && firstMismatch == count)
+      firstMismatch = i + LowestSetBit(mask);
+  }
+
+  BulkCompareResult result = {count - mismatchCount, firstMismatch,
+                              _mm512_reduce_max_epu32(maxDist)};
+  return result;
+}
+
+#ifdef _MSC_VER
+// Returns true if the OS saves the register state selected by mask (bits 1-2
+// for AVX, bits 5-7 for AVX-512).
+bool OSSupportsState(unsigned long long mask) {
+  int info[4];
+  __cpuid(info, 1);
+  // OSXSAVE has to be set before xgetbv can be used.
+  if (!(info[2] & (1 << 27)))
+    return false;
+  return (_xgetbv(0) & mask) == mask;
+}
+#endif
+
+bool CPUSupports(BulkKernel kernel) {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  __cpuidex(info, 7, 0);
+  if (kernel == BulkKernel::AVX2)
+    return (info[1] & (1 << 5)) && OSSupportsState(0x6);
+  return (info[1] & (1 << 16)) && OSSupportsState(0xE6);
+#else
+  // __builtin_cpu_supports also checks that the OS saves the registers.
+  if (kernel == BulkKernel::AVX2)
+    return __builtin_cpu_supports("avx2");
+  return __builtin_cpu_supports("avx512f");
+#endif
+}
+
+#endif  // BULK_COMPARE_X86
+
+}  // namespace
+
+uint32_t UlpDistanceFinal(float A, float B) {
+  return ulps::UlpDistance<float, ulps::kAllChecks>(A, B);
+}
+
+bool BulkKernelSupported(BulkKernel kernel) {
+  switch (kernel) {
+  case BulkKernel::Scalar:
+    return true;
+#ifdef BULK_COMPARE_X86
+  case BulkKernel::SSE2:
+    // Guaranteed on x64. Assumed on x86 since nothing older is interesting.
+    return true;
+  case BulkKernel::AVX2:
+  case BulkKernel::AVX512: {
+    static const bool avx2 = CPUSupports(BulkKernel::AVX2);
+    static const bool avx512 = CPUSupports(BulkKernel::AVX512);
+    return kernel == BulkKernel::AVX2 ? avx2 : avx512;
+  }
+#endif
+  default:
+    return false;
+  }
+}
+
+BulkKernel BestBulkKernel() {
+  static const BulkKernel best = [] {
+    if (BulkKernelSupported(BulkKernel::AVX512))
+      return BulkKernel::AVX512;
+    if (BulkKernelSupported(BulkKernel::AVX2))
+      return BulkKernel::AVX2;
+    if (BulkKernelSupported(BulkKernel::SSE2))
+      return BulkKernel::SSE2;
+    return BulkKernel::Scalar;
+  }();
+  return best;
+}
+
+const char* BulkKernelName(BulkKernel kernel) {
+  switch (kernel) {
+  case BulkKernel::Scalar:
+    return "scalar";
+  case BulkKernel::SSE2:
+    return "SSE2";
+  case BulkKernel::AVX2:
+    return "AVX2";
+  case BulkKernel::AVX512:
+    return "AVX-512";
+  }
+  return "unknown";
+}
+
+BulkCompareResult AlmostEqualUlpsBulk(const float* A, const float* B,
+                                      size_t count, int maxUlps) {
+  return AlmostEqualUlpsBulk(A, B, count, maxUlps, BestBulkKernel());
+}
+
+BulkCompareResult AlmostEqualUlpsBulk(const float* A, const float* B,
+                                      size_t count, int maxUlps,
+                                      BulkKernel kernel) {
+  assert(maxUlps >= 0);
+  assert(BulkKernelSupported(kernel));
+  auto compare = CompareScalar;
+#ifdef BULK_COMPARE_X86
+  if (kernel == BulkKernel::SSE2)
+    compare = CompareSSE2;
+  else if (kernel == BulkKernel::AVX2)
+    compare = CompareAVX2;
+  else if (kernel == BulkKernel::AVX512)
+    compare = CompareAVX512;
+#endif
+
+  BulkCompareResult result = {0, count, 0};
+  for (size_t offset = 0; offset < count; offset += kMaxChunk) {
+    size_t chunk = count - offset;
+    if (chunk > kMaxChunk)
+      chunk = kMaxChunk;
+    BulkCompareResult partial =
+        compare(A + offset, B + offset, chunk, uint32_t(maxUlps));
+    result.matchCount += partial.matchCount;
+    if (result.firstMismatch == count && partial.firstMismatch != chunk)
+      result.firstMismatch = offset + partial.firstMismatch;
+    if (partial.maxUlps > result.maxUlps)
+      result.maxUlps = partial.maxUlps;
+  }
+  return result;
+}
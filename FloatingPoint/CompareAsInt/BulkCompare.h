@@ -0,0 +1,70 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+BulkCompare.h - compare whole arrays of floats using the same rules as
+AlmostEqualUlpsFinal (with INFINITYCHECK, NANCHECK and SIGNCHECK all enabled)
+but using SSE2, AVX2 or AVX-512 kernels that are selected at run time.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ULP distance reported for pairs that AlmostEqualUlpsFinal will never treat
+// as equal, regardless of maxUlps - NANs, an infinity compared to anything
+// other than itself, and non-zero numbers of opposite signs.
+constexpr uint32_t kUlpsIncomparable = 0xFFFFFFFF;
+
+struct BulkCompareResult {
+  // Number of pairs for which AlmostEqualUlpsFinal would return true.
+  size_t matchCount;
+  // Index of the first pair that did not match, or count if they all did.
+  size_t firstMismatch;
+  // Largest ULP distance seen, or kUlpsIncomparable if any pair was
+  // incomparable.
+  uint32_t maxUlps;
+};
+
+enum class BulkKernel {
+  Scalar,
+  SSE2,
+  AVX2,
+  AVX512,
+};
+
+// Returns true if the kernel can run on this CPU/OS.
+bool BulkKernelSupported(BulkKernel kernel);
+// Returns the fastest kernel that can run on this CPU/OS.
+BulkKernel BestBulkKernel();
+const char* BulkKernelName(BulkKernel kernel);
+
+// Returns the ULP distance between A and B using the AlmostEqualUlpsFinal
+// rules, so AlmostEqualUlpsFinal(A, B, maxUlps) is equivalent to
+// UlpDistanceFinal(A, B) <= maxUlps for any non-negative maxUlps.
+uint32_t UlpDistanceFinal(float A, float B);
+
+// Compare A[i] to B[i] for every i less than count. maxUlps must be
+// non-negative. The results are identical to calling AlmostEqualUlpsFinal on
+// each pair, whichever kernel is used.
+BulkCompareResult AlmostEqualUlpsBulk(const float* A, const float* B,
+                                      size_t count, int maxUlps);
+// Same as above but with an explicitly chosen kernel, for testing and
+// benchmarking. The kernel must be supported.
+BulkCompareResult AlmostEqualUlpsBulk(const float* A, const float* B,
+                                      size_t count, int maxUlps,
+                                      BulkKernel kernel);
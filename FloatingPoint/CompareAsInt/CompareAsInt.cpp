@@ -15,177 +15,20 @@
 */
 
 /*
-CompareAsInt.cpp - various functions to compare floating point numbers using
-integer operations, other functions to test these comparisons, and other
-functions to print out floating point numbers and their representation.
+CompareAsInt.cpp - functions to test the comparisons in CompareAsInt.h, and
+other functions to print out floating point numbers and their
+representation.
 */
 
 #include <assert.h>
 #include <float.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-// Non-optimal AlmostEqual function - not recommended.
-bool AlmostEqualRelative(float A, float B, float maxRelativeError) {
-  if (A == B)
-    return true;
-  float relativeError = fabsf((A - B) / B);
-  if (relativeError <= maxRelativeError)
-    return true;
-  return false;
-}
-
-// Slightly better AlmostEqual function  still not recommended
-bool AlmostEqualRelative2(float A, float B, float maxRelativeError) {
-  if (A == B)
-    return true;
-  float relativeError;
-  if (fabsf(B) > fabsf(A))
-    relativeError = fabsf((A - B) / B);
-  else
-    relativeError = fabsf((A - B) / A);
-  if (relativeError <= maxRelativeError)
-    return true;
-  return false;
-}
-
-// Slightly better AlmostEqual function  still not recommended
-bool AlmostEqualRelativeOrAbsolute(float A, float B, float maxRelativeError,
-                                   float maxAbsoluteError) {
-  if (fabsf(A - B) < maxAbsoluteError)
-    return true;
-  float relativeError;
-  if (fabsf(B) > fabsf(A))
-    relativeError = fabsf((A - B) / B);
-  else
-    relativeError = fabsf((A - B) / A);
-  if (relativeError <= maxRelativeError)
-    return true;
-  return false;
-}
-
-// Initial AlmostEqualULPs version - fast and simple, but
-// some limitations.
-bool AlmostEqualUlps(float A, float B, int maxUlps) {
-  if (A == B)
-    return true;
-  int intDiff = abs(*(int *)&A - *(int *)&B);
-  if (intDiff <= maxUlps)
-    return true;
-  return false;
-}
-
-// Usable AlmostEqual function
-bool AlmostEqual2sComplement(float A, float B, int maxUlps) {
-  // Make sure maxUlps is non-negative and small enough that the
-  // default NAN won't compare as equal to anything.
-  // This check disabled for now so that my tests run properly.
-  // This assert should be enabled for normal use.
-  // assert(maxUlps > 0 && maxUlps < 4 * 1024 * 1024);
-  int aInt = *(int *)&A;
-  // Make aInt lexicographically ordered as a twos-complement int
-  if (aInt < 0)
-    aInt = 0x80000000 - aInt;
-  // Make bInt lexicographically ordered as a twos-complement int
-  int bInt = *(int *)&B;
-  if (bInt < 0)
-    bInt = 0x80000000 - bInt;
-  int intDiff = abs(aInt - bInt);
-  if (intDiff <= maxUlps)
-    return true;
-  return false;
-}
-
-// Support functions and conditional compilation directives for the
-// master AlmostEqual function.
-#define INFINITYCHECK
-#define NANCHECK
-#define SIGNCHECK
-
-inline bool IsInfinite(float A) {
-  const int kInfAsInt = 0x7F800000;
-
-  // An infinity has an exponent of 255 (shift left 23 positions) and
-  // a zero mantissa. There are two infinities - positive and negative.
-  if ((*(int *)&A & 0x7FFFFFFF) == kInfAsInt)
-    return true;
-  return false;
-}
-
-inline bool IsNan(float A) {
-  // A NAN has an exponent of 255 (shifted left 23 positions) and
-  // a non-zero mantissa.
-  int exp = *(int *)&A & 0x7F800000;
-  int mantissa = *(int *)&A & 0x007FFFFF;
-  if (exp == 0x7F800000 && mantissa != 0)
-    return true;
-  return false;
-}
-
-inline int Sign(float A) {
-  // The sign bit of a number is the high bit.
-  return (*(int *)&A) & 0x80000000;
-}
-
-// This is the 'final' version of the AlmostEqualUlps function.
-// The optional checks are included for completeness, but in many
-// cases they are not necessary, or even not desirable.
-bool AlmostEqualUlpsFinal(float A, float B, int maxUlps) {
-  // There are several optional checks that you can do, depending
-  // on what behavior you want from your floating point comparisons.
-  // These checks should not be necessary and they are included
-  // mainly for completeness.
-
-#ifdef INFINITYCHECK
-  // If A or B are infinity (positive or negative) then
-  // only return true if they are exactly equal to each other -
-  // that is, if they are both infinities of the same sign.
-  // This check is only needed if you will be generating
-  // infinities and you don't want them 'close' to numbers
-  // near FLT_MAX.
-  if (IsInfinite(A) || IsInfinite(B))
-    return A == B;
-#endif
-
-#ifdef NANCHECK
-  // If A or B are a NAN, return false. NANs are equal to nothing,
-  // not even themselves.
-  // This check is only needed if you will be generating NANs
-  // and you use a maxUlps greater than 4 million or you want to
-  // ensure that a NAN does not equal itself.
-  if (IsNan(A) || IsNan(B))
-    return false;
-#endif
-
-#ifdef SIGNCHECK
-  // After adjusting floats so their representations are lexicographically
-  // ordered as twos-complement integers a very small positive number
-  // will compare as 'close' to a very small negative number. If this is
-  // not desireable, and if you are on a platform that supports
-  // subnormals (which is the only place the problem can show up) then
-  // you need this check.
-  // The check for A == B is because zero and negative zero have different
-  // signs but are equal to each other.
-  if (Sign(A) != Sign(B))
-    return A == B;
-#endif
-
-  int aInt = *(int *)&A;
-  // Make aInt lexicographically ordered as a twos-complement int
-  if (aInt < 0)
-    aInt = 0x80000000 - aInt;
-  // Make bInt lexicographically ordered as a twos-complement int
-  int bInt = *(int *)&B;
-  if (bInt < 0)
-    bInt = 0x80000000 - bInt;
-
-  // Now we can compare aInt and bInt to find out how far apart A and B
-  // are.
-  int intDiff = abs(aInt - bInt);
-  if (intDiff <= maxUlps)
-    return true;
-  return false;
-}
+#include "BulkCompare.h"
+#include "CompareAsInt.h"
+#include "FloatUlps.h"
 
 // Function to test the TestCompare2sComplement function
 void TestCompare2sComplement(float A, float B, bool expectedResult,
@@ -204,10 +47,55 @@ void TestCompareFinal(float A, float B, bool expectedResult, int maxUlps = 10) {
            maxUlps, expectedResult ? "true" : "false");
 }
 
-// Function to test the TestCompareFinal amd TestCompare2sComplement functions
+// Function to test the templated ulps::AlmostEqualUlps function, which should
+// always agree with AlmostEqualUlpsFinal.
+void TestCompareTemplate(float A, float B, bool expectedResult,
+                         int maxUlps = 10) {
+  bool result = ulps::AlmostEqualUlps(A, B, maxUlps);
+  if (result != expectedResult)
+    printf("Unexpected result template - %1.9f, %1.9f, %d, expected %s\n", A,
+           B, maxUlps, expectedResult ? "true" : "false");
+}
+
+// The templated functions are constexpr so the other widths can be tested at
+// compile time.
+static_assert(ulps::UlpDistance(1.0f, 1.0000001f) == 1);
+static_assert(ulps::UlpDistance(1.0, 1.0000000000000002) == 1);
+static_assert(ulps::UlpDistance(0.0, -0.0) == 0);
+static_assert(ulps::UlpDistance(1.0, -1.0) == ulps::kIncomparable<double>);
+static_assert(ulps::UlpDistance<double, ulps::kNoChecks>(DBL_MIN, -DBL_MIN) ==
+              0x0020000000000000);
+// Half: 1.0 and the next number up.
+static_assert(ulps::AlmostEqualUlps(ulps::Half{0x3C00}, ulps::Half{0x3C01}, 1));
+// Half: 65504 (the largest finite value) and infinity.
+static_assert(!ulps::AlmostEqualUlps(ulps::Half{0x7BFF}, ulps::Half{0x7C00}, 1));
+static_assert(ulps::AlmostEqualUlps<ulps::Half, ulps::kNoChecks>(
+    ulps::Half{0x7BFF}, ulps::Half{0x7C00}, 1));
+// Half: a NAN only equals itself if the NAN check is disabled.
+static_assert(!ulps::AlmostEqualUlps(ulps::Half{0x7E00}, ulps::Half{0x7E00}, 1));
+static_assert(ulps::AlmostEqualUlps<ulps::Half, ulps::kInfinityCheck>(
+    ulps::Half{0x7E00}, ulps::Half{0x7E00}, 0));
+// BFloat16: the smallest denormals of each sign are only two apart.
+static_assert(ulps::UlpDistance<ulps::BFloat16, ulps::kNoChecks>(
+                  ulps::BFloat16{0x0001}, ulps::BFloat16{0x8001}) == 2);
+static_assert(ulps::UlpDistance(ulps::BFloat16{0x0001},
+                                ulps::BFloat16{0x8001}) ==
+              ulps::kIncomparable<ulps::BFloat16>);
+static_assert(ulps::UlpDistance(ulps::BFloat16{0x0000},
+                                ulps::BFloat16{0x8000}) == 0);
+// SortKey keeps -0 and +0 distinct, and round trips.
+static_assert(ulps::SortKey(-0.0f) + 1 == ulps::SortKey(0.0f));
+static_assert(ulps::SortKey(-1.0) < ulps::SortKey(-0.5));
+static_assert(ulps::FromSortKey<double>(ulps::SortKey(-2.5)) == -2.5);
+static_assert(ulps::FromSortKey<ulps::Half>(ulps::SortKey(ulps::Half{0x8001}))
+                  .bits == 0x8001);
+
+// Function to test the TestCompareFinal, TestCompare2sComplement and
+// TestCompareTemplate functions
 void TestCompareAll(float A, float B, bool expectedResult, int maxUlps = 10) {
   TestCompare2sComplement(A, B, expectedResult, maxUlps);
   TestCompareFinal(A, B, expectedResult, maxUlps);
+  TestCompareTemplate(A, B, expectedResult, maxUlps);
 }
 
 // Function to print a number and its representation, in hex and decimal
@@ -261,6 +149,94 @@ void PrintNumbers() {
   PrintNumber(10000.0f, 1);
 }
 
+// Reference ULP distance for validating the bulk comparisons, built from
+// AlmostEqualUlpsFinal and the AlmostEqual2sComplement integer mapping.
+uint32_t ReferenceUlpDistance(float A, float B) {
+  if (!AlmostEqualUlpsFinal(A, B, 0x7FFFFFFF))
+    return kUlpsIncomparable;
+  int aInt = *(int *)&A;
+  if (aInt < 0)
+    aInt = 0x80000000 - aInt;
+  int bInt = *(int *)&B;
+  if (bInt < 0)
+    bInt = 0x80000000 - bInt;
+  return abs(aInt - bInt);
+}
+
+// Function to test that AlmostEqualUlpsBulk gives the same answers as
+// AlmostEqualUlpsFinal, with every kernel that this CPU supports.
+void TestBulkCompare() {
+  // A mix of special numbers to pair up with each other and with random
+  // numbers.
+  const unsigned kSpecials[] = {
+      0x00000000, 0x80000000, 0x00000001, 0x80000001, 0x7F7FFFFF,
+      0xFF7FFFFF, 0x7F800000, 0xFF800000, 0x7FC00000, 0xFFC00000,
+      0x7F800001, 0x3F800000, 0xBF800000, 0x00800000, 0x007FFFFF,
+  };
+  const int kNumSpecials = sizeof(kSpecials) / sizeof(kSpecials[0]);
+  // An odd size so that the scalar tails get tested.
+  const int kCount = 10007;
+  float *A = new float[kCount];
+  float *B = new float[kCount];
+  srand(1);
+  for (int i = 0; i < kCount; ++i) {
+    // Build 32-bit patterns even where RAND_MAX is only 0x7FFF.
+    int aInt = int((unsigned(rand()) << 20) ^ (unsigned(rand()) << 10) ^ rand());
+    int bInt = aInt + rand() % 41 - 20;
+    switch (rand() % 4) {
+    case 0:
+      aInt = int(kSpecials[rand() % kNumSpecials]);
+      break;
+    case 1:
+      bInt = int(kSpecials[rand() % kNumSpecials]);
+      break;
+    case 2:
+      bInt = aInt;
+      break;
+    }
+    *(int *)&A[i] = aInt;
+    *(int *)&B[i] = bInt;
+  }
+
+  const BulkKernel kKernels[] = {BulkKernel::Scalar, BulkKernel::SSE2,
+                                 BulkKernel::AVX2, BulkKernel::AVX512};
+  const int kMaxUlps[] = {0, 1, 10, 4 * 1024 * 1024, 0x7FFFFFFF};
+  // Check different lengths and alignments.
+  const int kOffsets[] = {0, 1, 3, 7, 15, 17};
+  for (BulkKernel kernel : kKernels) {
+    if (!BulkKernelSupported(kernel))
+      continue;
+    for (int maxUlps : kMaxUlps) {
+      for (int offset : kOffsets) {
+        int count = kCount - offset * 3;
+        BulkCompareResult expected = {0, size_t(count), 0};
+        for (int i = 0; i < count; ++i) {
+          if (AlmostEqualUlpsFinal(A[offset + i], B[offset + i], maxUlps))
+            ++expected.matchCount;
+          else if (expected.firstMismatch == size_t(count))
+            expected.firstMismatch = i;
+          uint32_t dist = ReferenceUlpDistance(A[offset + i], B[offset + i]);
+          if (dist > expected.maxUlps)
+            expected.maxUlps = dist;
+        }
+        BulkCompareResult result =
+            AlmostEqualUlpsBulk(A + offset, B + offset, count, maxUlps, kernel);
+        if (result.matchCount != expected.matchCount ||
+            result.firstMismatch != expected.firstMismatch ||
+            result.maxUlps != expected.maxUlps)
+          printf("Unexpected result bulk %s - %d, %d, got %zu/%zu/%u, "
+                 "expected %zu/%zu/%u\n",
+                 BulkKernelName(kernel), maxUlps, offset, result.matchCount,
+                 result.firstMismatch, result.maxUlps, expected.matchCount,
+                 expected.firstMismatch, expected.maxUlps);
+      }
+    }
+  }
+
+  delete[] A;
+  delete[] B;
+}
+
 float zero1, zero2;
 
 int main(int argc, char *argv[]) {
@@ -317,23 +293,31 @@ int main(int argc, char *argv[]) {
   // Test wrapping from inf to -inf when maxUlps is too large.
   TestCompare2sComplement(inf, -inf, true, 16 * 1024 * 1024);
   TestCompareFinal(inf, -inf, false, 16 * 1024 * 1024);
+  TestCompareTemplate(inf, -inf, false, 16 * 1024 * 1024);
 
   // Test whether FLT_MAX and infinity (representationally adjacent)
   // compare as equal.
   TestCompare2sComplement(FLT_MAX, inf, true);
   TestCompareFinal(FLT_MAX, inf, false);
+  TestCompareTemplate(FLT_MAX, inf, false);
 
   // Test whether a NAN compares as equal to itself.
   TestCompare2sComplement(nan2, nan2, true);
   TestCompareFinal(nan2, nan2, false);
+  TestCompareTemplate(nan2, nan2, false);
 
   // Test whether a NAN compares as equal to a different NAN.
   TestCompare2sComplement(nan2, nan3, true);
   TestCompareFinal(nan2, nan3, false);
+  TestCompareTemplate(nan2, nan3, false);
 
   // Test whether tiny numbers of opposite signs compare as equal.
   TestCompare2sComplement(smallestDenormal, -smallestDenormal, true);
   TestCompareFinal(smallestDenormal, -smallestDenormal, false);
+  TestCompareTemplate(smallestDenormal, -smallestDenormal, false);
+
+  // Make sure the SIMD array comparisons exactly match the scalar function.
+  TestBulkCompare();
 
   return 0;
 }
@@ -0,0 +1,188 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+CompareAsInt.h - various functions to compare floating point numbers using
+integer operations. These are the functions discussed in the article, shared
+by CompareAsInt.cpp and the other tools in this directory.
+*/
+
+#pragma once
+
+#include <math.h>
+#include <stdlib.h>
+
+// Non-optimal AlmostEqual function - not recommended.
+inline bool AlmostEqualRelative(float A, float B, float maxRelativeError) {
+  if (A == B)
+    return true;
+  float relativeError = fabsf((A - B) / B);
+  if (relativeError <= maxRelativeError)
+    return true;
+  return false;
+}
+
+// Slightly better AlmostEqual function  still not recommended
+inline bool AlmostEqualRelative2(float A, float B, float maxRelativeError) {
+  if (A == B)
+    return true;
+  float relativeError;
+  if (fabsf(B) > fabsf(A))
+    relativeError = fabsf((A - B) / B);
+  else
+    relativeError = fabsf((A - B) / A);
+  if (relativeError <= maxRelativeError)
+    return true;
+  return false;
+}
+
+// Slightly better AlmostEqual function  still not recommended
+inline bool AlmostEqualRelativeOrAbsolute(float A, float B, float maxRelativeError,
+                                   float maxAbsoluteError) {
+  if (fabsf(A - B) < maxAbsoluteError)
+    return true;
+  float relativeError;
+  if (fabsf(B) > fabsf(A))
+    relativeError = fabsf((A - B) / B);
+  else
+    relativeError = fabsf((A - B) / A);
+  if (relativeError <= maxRelativeError)
+    return true;
+  return false;
+}
+
+// Initial AlmostEqualULPs version - fast and simple, but
+// some limitations.
+inline bool AlmostEqualUlps(float A, float B, int maxUlps) {
+  if (A == B)
+    return true;
+  int intDiff = abs(*(int *)&A - *(int *)&B);
+  if (intDiff <= maxUlps)
+    return true;
+  return false;
+}
+
+// Usable AlmostEqual function
+inline bool AlmostEqual2sComplement(float A, float B, int maxUlps) {
+  // Make sure maxUlps is non-negative and small enough that the
+  // default NAN won't compare as equal to anything.
+  // This check disabled for now so that my tests run properly.
+  // This assert should be enabled for normal use.
+  // assert(maxUlps > 0 && maxUlps < 4 * 1024 * 1024);
+  int aInt = *(int *)&A;
+  // Make aInt lexicographically ordered as a twos-complement int
+  if (aInt < 0)
+    aInt = 0x80000000 - aInt;
+  // Make bInt lexicographically ordered as a twos-complement int
+  int bInt = *(int *)&B;
+  if (bInt < 0)
+    bInt = 0x80000000 - bInt;
+  int intDiff = abs(aInt - bInt);
+  if (intDiff <= maxUlps)
+    return true;
+  return false;
+}
+
+// Support functions and conditional compilation directives for the
+// master AlmostEqual function.
+#define INFINITYCHECK
+#define NANCHECK
+#define SIGNCHECK
+
+inline bool IsInfinite(float A) {
+  const int kInfAsInt = 0x7F800000;
+
+  // An infinity has an exponent of 255 (shift left 23 positions) and
+  // a zero mantissa. There are two infinities - positive and negative.
+  if ((*(int *)&A & 0x7FFFFFFF) == kInfAsInt)
+    return true;
+  return false;
+}
+
+inline bool IsNan(float A) {
+  // A NAN has an exponent of 255 (shifted left 23 positions) and
+  // a non-zero mantissa.
+  int exp = *(int *)&A & 0x7F800000;
+  int mantissa = *(int *)&A & 0x007FFFFF;
+  if (exp == 0x7F800000 && mantissa != 0)
+    return true;
+  return false;
+}
+
+inline int Sign(float A) {
+  // The sign bit of a number is the high bit.
+  return (*(int *)&A) & 0x80000000;
+}
+
+// This is the 'final' version of the AlmostEqualUlps function.
+// The optional checks are included for completeness, but in many
+// cases they are not necessary, or even not desirable.
+inline bool AlmostEqualUlpsFinal(float A, float B, int maxUlps) {
+  // There are several optional checks that you can do, depending
+  // on what behavior you want from your floating point comparisons.
+  // These checks should not be necessary and they are included
+  // mainly for completeness.
+
+#ifdef INFINITYCHECK
+  // If A or B are infinity (positive or negative) then
+  // only return true if they are exactly equal to each other -
+  // that is, if they are both infinities of the same sign.
+  // This check is only needed if you will be generating
+  // infinities and you don't want them 'close' to numbers
+  // near FLT_MAX.
+  if (IsInfinite(A) || IsInfinite(B))
+    return A == B;
+#endif
+
+#ifdef NANCHECK
+  // If A or B are a NAN, return false. NANs are equal to nothing,
+  // not even themselves.
+  // This check is only needed if you will be generating NANs
+  // and you use a maxUlps greater than 4 million or you want to
+  // ensure that a NAN does not equal itself.
+  if (IsNan(A) || IsNan(B))
+    return false;
+#endif
+
+#ifdef SIGNCHECK
+  // After adjusting floats so their representations are lexicographically
+  // ordered as twos-complement integers a very small positive number
+  // will compare as 'close' to a very small negative number. If this is
+  // not desireable, and if you are on a platform that supports
+  // subnormals (which is the only place the problem can show up) then
+  // you need this check.
+  // The check for A == B is because zero and negative zero have different
+  // signs but are equal to each other.
+  if (Sign(A) != Sign(B))
+    return A == B;
+#endif
+
+  int aInt = *(int *)&A;
+  // Make aInt lexicographically ordered as a twos-complement int
+  if (aInt < 0)
+    aInt = 0x80000000 - aInt;
+  // Make bInt lexicographically ordered as a twos-complement int
+  int bInt = *(int *)&B;
+  if (bInt < 0)
+    bInt = 0x80000000 - bInt;
+
+  // Now we can compare aInt and bInt to find out how far apart A and B
+  // are.
+  int intDiff = abs(aInt - bInt);
+  if (intDiff <= maxUlps)
+    return true;
+  return false;
+}
@@ -0,0 +1,315 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+CompareBench.cpp - measures the cost of each of the comparison functions in
+CompareAsInt.h, and of the branchless rewrites in BranchlessCompare.h, on
+several input distributions.
+
+The early-outs in the original functions are free when the data is
+predictable (all equal, or sorted so that the results come in long runs) and
+expensive when it isn't (random closeness, NANs scattered through the data,
+random signs in denormals). The branchless versions cost the same on all
+data. On Linux the branch-miss rate is also reported, using perf counters,
+when they are available.
+
+Usage:
+  CompareBench [-count N] [-maxulps N]
+*/
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "BranchlessCompare.h"
+#include "CompareAsInt.h"
+
+// Parameters for the comparisons. maxRelativeError is roughly equivalent to
+// maxUlps for numbers near 1.0.
+int maxUlps = 10;
+float maxRelativeError = 10 * FLT_EPSILON;
+const float kMaxAbsoluteError = FLT_MIN;
+
+// Two-argument wrappers so that every comparison can be passed as a template
+// argument and inlined into the timing loop.
+bool Relative(float A, float B) {
+  return AlmostEqualRelative(A, B, maxRelativeError);
+}
+bool Relative2(float A, float B) {
+  return AlmostEqualRelative2(A, B, maxRelativeError);
+}
+bool RelativeOrAbsolute(float A, float B) {
+  return AlmostEqualRelativeOrAbsolute(A, B, maxRelativeError,
+                                       kMaxAbsoluteError);
+}
+bool Ulps(float A, float B) { return AlmostEqualUlps(A, B, maxUlps); }
+bool TwosComplement(float A, float B) {
+  return AlmostEqual2sComplement(A, B, maxUlps);
+}
+bool UlpsFinal(float A, float B) {
+  return AlmostEqualUlpsFinal(A, B, maxUlps);
+}
+bool RelativeBranchless(float A, float B) {
+  return AlmostEqualRelativeBranchless(A, B, maxRelativeError);
+}
+bool Relative2Branchless(float A, float B) {
+  return AlmostEqualRelative2Branchless(A, B, maxRelativeError);
+}
+bool RelativeOrAbsoluteBranchless(float A, float B) {
+  return AlmostEqualRelativeOrAbsoluteBranchless(A, B, maxRelativeError,
+                                                 kMaxAbsoluteError);
+}
+bool UlpsBranchless(float A, float B) {
+  return AlmostEqualUlpsBranchless(A, B, maxUlps);
+}
+bool TwosComplementBranchless(float A, float B) {
+  return AlmostEqual2sComplementBranchless(A, B, maxUlps);
+}
+bool UlpsFinalBranchless(float A, float B) {
+  return AlmostEqualUlpsFinalBranchless(A, B, maxUlps);
+}
+
+template <bool (*Compare)(float, float)>
+size_t CountMatches(const float *A, const float *B, size_t count) {
+  size_t matches = 0;
+  for (size_t i = 0; i < count; ++i)
+    matches += Compare(A[i], B[i]);
+  return matches;
+}
+
+struct Comparison {
+  const char *name;
+  bool (*compare)(float, float);
+  size_t (*countMatches)(const float *, const float *, size_t);
+};
+
+// Each original is followed by its branchless rewrite.
+const Comparison kComparisons[] = {
+    {"AlmostEqualRelative", Relative, CountMatches<Relative>},
+    {"  branchless", RelativeBranchless, CountMatches<RelativeBranchless>},
+    {"AlmostEqualRelative2", Relative2, CountMatches<Relative2>},
+    {"  branchless", Relative2Branchless, CountMatches<Relative2Branchless>},
+    {"AlmostEqualRelativeOrAbsolute", RelativeOrAbsolute,
+     CountMatches<RelativeOrAbsolute>},
+    {"  branchless", RelativeOrAbsoluteBranchless,
+     CountMatches<RelativeOrAbsoluteBranchless>},
+    {"AlmostEqualUlps", Ulps, CountMatches<Ulps>},
+    {"  branchless", UlpsBranchless, CountMatches<UlpsBranchless>},
+    {"AlmostEqual2sComplement", TwosComplement, CountMatches<TwosComplement>},
+    {"  branchless", TwosComplementBranchless,
+     CountMatches<TwosComplementBranchless>},
+    {"AlmostEqualUlpsFinal", UlpsFinal, CountMatches<UlpsFinal>},
+    {"  branchless", UlpsFinalBranchless, CountMatches<UlpsFinalBranchless>},
+};
+
+struct Distribution {
+  const char *name;
+  std::vector<float> A;
+  std::vector<float> B;
+};
+
+float AddUlps(float f, int ulps) {
+  int i = std::bit_cast<int>(f) + ulps;
+  return std::bit_cast<float>(i);
+}
+
+// Builds the input distributions. Apart from "equal", B is A moved by up to
+// twice maxUlps, so roughly half of the pairs are close enough to match.
+std::vector<Distribution> MakeDistributions(size_t count) {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> values(-1000.0f, 1000.0f);
+  std::uniform_int_distribution<int> jitter(-2 * maxUlps, 2 * maxUlps);
+  std::uniform_int_distribution<int> denormals(1, 0x007FFFFF);
+
+  std::vector<Distribution> distributions(5);
+  for (auto& d : distributions) {
+    d.A.resize(count);
+    d.B.resize(count);
+  }
+  distributions[0].name = "equal";
+  distributions[1].name = "random";
+  distributions[2].name = "sorted";
+  distributions[3].name = "NAN-heavy";
+  distributions[4].name = "denormal-heavy";
+  std::vector<std::pair<int, float>> sorted(count);
+  for (size_t i = 0; i < count; ++i) {
+    float a = values(rng);
+    int offset = jitter(rng);
+    distributions[0].A[i] = distributions[0].B[i] = a;
+    distributions[1].A[i] = a;
+    distributions[1].B[i] = AddUlps(a, offset);
+    // Sorting by how far apart the pairs are means the results come in two
+    // long runs, which is as predictable as it gets.
+    sorted[i] = {abs(offset), a};
+    // Half of these pairs contain a NAN, at random.
+    distributions[3].A[i] = rng() % 2 ? NAN : a;
+    distributions[3].B[i] = AddUlps(a, offset);
+    // Denormals with random signs are where SIGNCHECK matters.
+    float denormal = std::bit_cast<float>(denormals(rng));
+    distributions[4].A[i] = rng() % 2 ? denormal : -denormal;
+    distributions[4].B[i] = AddUlps(distributions[4].A[i], offset);
+  }
+  std::sort(sorted.begin(), sorted.end());
+  for (size_t i = 0; i < count; ++i) {
+    distributions[2].A[i] = sorted[i].second;
+    distributions[2].B[i] = AddUlps(sorted[i].second, sorted[i].first);
+  }
+  return distributions;
+}
+
+// Counts branch misses in this thread, in user mode, where the OS allows it.
+class BranchMissCounter {
+public:
+  BranchMissCounter() {
+#ifdef __linux__
+    perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+  }
+  ~BranchMissCounter() {
+#ifdef __linux__
+    if (fd_ >= 0)
+      close(fd_);
+#endif
+  }
+
+  bool Available() const { return fd_ >= 0; }
+
+  void Start() {
+#ifdef __linux__
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  uint64_t Stop() {
+    uint64_t count = 0;
+#ifdef __linux__
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd_, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+    }
+#endif
+    return count;
+  }
+
+private:
+  int fd_ = -1;
+};
+
+int main(int argc, char *argv[]) {
+  size_t count = 4 * 1024 * 1024;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-count") == 0 && i + 1 < argc) {
+      count = size_t(strtoull(argv[++i], nullptr, 10));
+    } else if (strcmp(argv[i], "-maxulps") == 0 && i + 1 < argc) {
+      maxUlps = atoi(argv[++i]);
+      maxRelativeError = maxUlps * FLT_EPSILON;
+    } else {
+      printf("Usage: CompareBench [-count N] [-maxulps N]\n");
+      return 1;
+    }
+  }
+  if (count == 0 || maxUlps < 0) {
+    printf("Usage: CompareBench [-count N] [-maxulps N]\n");
+    return 1;
+  }
+
+  const std::vector<Distribution> distributions = MakeDistributions(count);
+
+  // The rewrites are only interesting if they give the same answers.
+  bool success = true;
+  for (size_t c = 0; c < std::size(kComparisons); c += 2) {
+    for (const auto& d : distributions) {
+      for (size_t i = 0; i < count; ++i) {
+        if (kComparisons[c].compare(d.A[i], d.B[i]) !=
+            kComparisons[c + 1].compare(d.A[i], d.B[i])) {
+          printf("Unexpected result branchless %s - %1.9g, %1.9g\n",
+                 kComparisons[c].name, d.A[i], d.B[i]);
+          success = false;
+          break;
+        }
+      }
+    }
+  }
+
+  BranchMissCounter branchMisses;
+  printf("%zu compares per run, maxUlps = %d. Each cell is ns per compare",
+         count, maxUlps);
+  if (branchMisses.Available())
+    printf(" / branch misses per compare");
+  else
+    printf(" (branch-miss counters are not available)");
+  printf(".\n\n%-30s", "");
+  for (const auto& d : distributions)
+    printf("%16s", d.name);
+  printf("\n");
+
+  const int kRuns = 5;
+  for (const auto& comparison : kComparisons) {
+    printf("%-30s", comparison.name);
+    for (const auto& d : distributions) {
+      // Take the fastest run to filter out interrupts and frequency changes.
+      double bestNs = 1e100;
+      uint64_t bestMisses = 0;
+      for (int run = 0; run < kRuns; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        branchMisses.Start();
+        volatile size_t matches =
+            comparison.countMatches(d.A.data(), d.B.data(), count);
+        (void)matches;
+        uint64_t misses = branchMisses.Stop();
+        std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - start;
+        if (elapsed.count() < bestNs) {
+          bestNs = elapsed.count();
+          bestMisses = misses;
+        }
+      }
+      if (branchMisses.Available())
+        printf("     %5.2f/%5.3f", bestNs / count, double(bestMisses) / count);
+      else
+        printf("%16.2f", bestNs / count);
+    }
+    printf("\n");
+  }
+  return success ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+FloatRadixSort.h - LSD radix sort for arrays of floats and doubles, optionally
+carrying a value along with each key.
+
+The floats are converted to unsigned integers with ulps::SortKey, which is
+the lexicographic ordering trick from AlmostEqual2sComplement made
+branchless and reversible. The integers are then sorted a byte at a time,
+least significant byte first. A single read of the input produces the
+histograms for every byte, and any byte that is the same for every key (the
+top byte of data with a narrow range, for instance) is skipped. The
+histogramming and scattering are split into blocks that run in parallel, and
+the sort is stable.
+
+The order is IEEE totalOrder: -NAN < -infinity < ... < -0 < +0 < ... <
++infinity < +NAN.
+
+Requires C++20.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <type_traits>
+#include <vector>
+
+#include "FloatUlps.h"
+#include "ParallelSweep.h"
+
+namespace radix_sort_internal {
+
+const int kDigitBits = 8;
+const size_t kBuckets = size_t(1) << kDigitBits;
+// Below this many elements per thread the threads cost more than they save.
+const size_t kMinBlockSize = 64 * 1024;
+
+// Marker for sorts that have no values.
+struct NoValue {};
+
+template <typename Key, typename Value>
+void Sort(Key *keys, Value *values, size_t count, unsigned threadCount) {
+  using Bits = typename ulps::FloatTraits<Key>::Bits;
+  constexpr bool kHasValues = !std::is_same_v<Value, NoValue>;
+  constexpr int kDigits = sizeof(Bits) * 8 / kDigitBits;
+  if (count < 2)
+    return;
+
+  size_t blockCount = count / kMinBlockSize;
+  if (blockCount > threadCount)
+    blockCount = threadCount;
+  if (blockCount == 0)
+    blockCount = 1;
+  const size_t blockSize = (count + blockCount - 1) / blockCount;
+  auto blockBegin = [&](size_t block) {
+    return block * blockSize < count ? block * blockSize : count;
+  };
+
+  std::vector<Bits> keyBuffers[2] = {std::vector<Bits>(count),
+                                     std::vector<Bits>(count)};
+  std::vector<Value> valueBuffers[2];
+  if constexpr (kHasValues) {
+    valueBuffers[0].assign(values, values + count);
+    valueBuffers[1].resize(count);
+  }
+
+  // Transform the keys and histogram every digit in a single pass. The
+  // per-block histograms are only needed to decide which digits to skip.
+  std::vector<size_t> digitCounts(blockCount * kDigits * kBuckets);
+  ParallelSweep(0, blockCount, 1, threadCount,
+                [&](unsigned, uint64_t block, uint64_t) {
+    size_t *counts = &digitCounts[block * kDigits * kBuckets];
+    Bits *out = keyBuffers[0].data();
+    for (size_t i = blockBegin(block); i < blockBegin(block + 1); ++i) {
+      Bits key = ulps::SortKey(keys[i]);
+      out[i] = key;
+      for (int digit = 0; digit < kDigits; ++digit) {
+        size_t bucket = (key >> (digit * kDigitBits)) & (kBuckets - 1);
+        ++counts[digit * kBuckets + bucket];
+      }
+    }
+  });
+
+  int current = 0;
+  std::vector<size_t> offsets(blockCount * kBuckets);
+  for (int digit = 0; digit < kDigits; ++digit) {
+    const int shift = digit * kDigitBits;
+    // If every key has the same value for this digit then the pass would not
+    // move anything.
+    bool skip = false;
+    for (size_t bucket = 0; bucket < kBuckets && !skip; ++bucket) {
+      size_t total = 0;
+      for (size_t block = 0; block < blockCount; ++block)
+        total += digitCounts[(block * kDigits + digit) * kBuckets + bucket];
+      skip = total == count;
+    }
+    if (skip)
+      continue;
+
+    const Bits *in = keyBuffers[current].data();
+    Bits *out = keyBuffers[current ^ 1].data();
+    // The blocks cover different elements on each pass so they need to be
+    // counted again.
+    if (blockCount > 1) {
+      ParallelSweep(0, blockCount, 1, threadCount,
+                    [&](unsigned, uint64_t block, uint64_t) {
+        size_t *counts = &offsets[block * kBuckets];
+        memset(counts, 0, kBuckets * sizeof(size_t));
+        for (size_t i = blockBegin(block); i < blockBegin(block + 1); ++i)
+          ++counts[(in[i] >> shift) & (kBuckets - 1)];
+      });
+    } else {
+      memcpy(offsets.data(), &digitCounts[digit * kBuckets],
+             kBuckets * sizeof(size_t));
+    }
+    // Convert the counts to starting offsets, ordered by bucket and then by
+    // block so that the sort is stable.
+    size_t next = 0;
+    for (size_t bucket = 0; bucket < kBuckets; ++bucket) {
+      for (size_t block = 0; block < blockCount; ++block) {
+        size_t blockCountInBucket = offsets[block * kBuckets + bucket];
+        offsets[block * kBuckets + bucket] = next;
+        next += blockCountInBucket;
+      }
+    }
+
+    const Value *valuesIn = nullptr;
+    Value *valuesOut = nullptr;
+    if constexpr (kHasValues) {
+      valuesIn = valueBuffers[current].data();
+      valuesOut = valueBuffers[current ^ 1].data();
+    }
+    ParallelSweep(0, blockCount, 1, threadCount,
+                  [&](unsigned, uint64_t block, uint64_t) {
+      size_t *blockOffsets = &offsets[block * kBuckets];
+      for (size_t i = blockBegin(block); i < blockBegin(block + 1); ++i) {
+        size_t bucket = (in[i] >> shift) & (kBuckets - 1);
+        size_t destination = blockOffsets[bucket]++;
+        out[destination] = in[i];
+        if constexpr (kHasValues)
+          valuesOut[destination] = valuesIn[i];
+      }
+    });
+    current ^= 1;
+  }
+
+  ParallelSweep(0, blockCount, 1, threadCount,
+                [&](unsigned, uint64_t block, uint64_t) {
+    const Bits *sorted = keyBuffers[current].data();
+    for (size_t i = blockBegin(block); i < blockBegin(block + 1); ++i) {
+      keys[i] = ulps::FromSortKey<Key>(sorted[i]);
+      if constexpr (kHasValues)
+        values[i] = valueBuffers[current][i];
+    }
+  });
+}
+
+}  // namespace radix_sort_internal
+
+// Sorts count floats or doubles in place. Uses 2 * count * sizeof(T) bytes of
+// temporary memory.
+template <typename T>
+void FloatRadixSort(T *keys, size_t count,
+                    unsigned threadCount = DefaultSweepThreads()) {
+  radix_sort_internal::NoValue *noValues = nullptr;
+  radix_sort_internal::Sort(keys, noValues, count, threadCount);
+}
+
+// Sorts count keys in place and moves values[i] along with keys[i]. Values
+// must be copyable. Equal keys keep their original order.
+template <typename T, typename Value>
+void FloatRadixSort(T *keys, Value *values, size_t count,
+                    unsigned threadCount = DefaultSweepThreads()) {
+  radix_sort_internal::Sort(keys, values, count, threadCount);
+}
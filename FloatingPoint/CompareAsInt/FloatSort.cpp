@@ -0,0 +1,134 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+FloatSort.cpp - checks FloatRadixSort against std::sort and compares their
+speed, for floats and doubles, with and without values.
+
+Usage:
+  FloatSort [count] [-threads N]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "FloatRadixSort.h"
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Random bit patterns are a good test because they contain every sign,
+// exponent, NAN and denormal, but they are not typical data so a quarter of
+// the numbers are from a narrow range, and some are exact duplicates to
+// check stability.
+template <typename T>
+std::vector<T> MakeData(size_t count) {
+  using Bits = typename ulps::FloatTraits<T>::Bits;
+  std::mt19937_64 rng(1);
+  std::uniform_real_distribution<T> narrow(T(-1000), T(1000));
+  std::vector<T> data(count);
+  for (size_t i = 0; i < count; ++i) {
+    switch (rng() % 4) {
+    case 0:
+      data[i] = ulps::FloatTraits<T>::FromBits(Bits(rng()));
+      break;
+    case 1:
+    case 2:
+      data[i] = narrow(rng);
+      break;
+    case 3:
+      data[i] = i ? data[rng() % i] : T(0);
+      break;
+    }
+  }
+  return data;
+}
+
+template <typename T>
+bool TestSort(const char *typeName, size_t count, unsigned threadCount) {
+  const std::vector<T> original = MakeData<T>(count);
+  // std::sort with SortKey gives the same total order, and sorting the
+  // indices too makes it a stable reference for the key/value sort.
+  std::vector<std::pair<typename ulps::FloatTraits<T>::Bits, uint32_t>>
+      reference(count);
+  for (size_t i = 0; i < count; ++i)
+    reference[i] = {ulps::SortKey(original[i]), uint32_t(i)};
+  auto start = std::chrono::steady_clock::now();
+  std::sort(reference.begin(), reference.end());
+  double stdSortTime = SecondsSince(start);
+
+  std::vector<T> keys = original;
+  start = std::chrono::steady_clock::now();
+  FloatRadixSort(keys.data(), count, threadCount);
+  double radixTime = SecondsSince(start);
+
+  std::vector<T> pairKeys = original;
+  std::vector<uint32_t> values(count);
+  for (size_t i = 0; i < count; ++i)
+    values[i] = uint32_t(i);
+  start = std::chrono::steady_clock::now();
+  FloatRadixSort(pairKeys.data(), values.data(), count, threadCount);
+  double pairTime = SecondsSince(start);
+
+  bool success = true;
+  for (size_t i = 0; i < count && success; ++i) {
+    if (ulps::SortKey(keys[i]) != reference[i].first ||
+        ulps::SortKey(pairKeys[i]) != reference[i].first ||
+        values[i] != reference[i].second) {
+      printf("Unexpected result %s sort - element %zu is wrong.\n", typeName,
+             i);
+      success = false;
+    }
+  }
+
+  // Tiny sorts are only for correctness.
+  if (count < 1000)
+    return success;
+  printf("%-6s: std::sort %7.3f s, radix sort %7.3f s (%4.1fx), "
+         "key/value %7.3f s.\n",
+         typeName, stdSortTime, radixTime, stdSortTime / radixTime, pairTime);
+  return success;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = 10 * 1000 * 1000;
+  unsigned threadCount = DefaultSweepThreads();
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+      threadCount = unsigned(atoi(argv[++i]));
+    else
+      count = size_t(strtoull(argv[i], nullptr, 10));
+  }
+  if (threadCount == 0)
+    threadCount = 1;
+
+  printf("Sorting %zu elements with %u threads.\n", count, threadCount);
+  // Check some tiny sizes as well, since they take different paths.
+  bool success = TestSort<float>("float", 3, threadCount) &&
+                 TestSort<double>("double", 3, threadCount);
+  success = TestSort<float>("float", count, threadCount) && success;
+  success = TestSort<double>("double", count, threadCount) && success;
+  return success ? 0 : 1;
+}
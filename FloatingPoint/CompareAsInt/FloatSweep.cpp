@@ -0,0 +1,341 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+FloatSweep.cpp - exhaustively test float comparisons and float math functions
+by sweeping through all four billion float bit patterns on all cores.
+
+With only four billion floats there is no need to guess at which values are
+interesting - you can just test them all. The hand-picked values in
+CompareAsInt.cpp's main show the documented differences between
+AlmostEqual2sComplement and AlmostEqualUlpsFinal, and -compare mode checks
+that those are the *only* differences, for every float and its neighbours.
+-function mode measures the maximum error of a math function such as floorf
+against a double-precision reference.
+
+Usage:
+  FloatSweep -compare [-maxulps N] [-radius N] [-threads N] [-range first last]
+  FloatSweep -function name [-threads N] [-range first last]
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+#include "CompareAsInt.h"
+#include "FloatUlps.h"
+#include "ParallelSweep.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_SSE41_FLOOR
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_SSE41
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#endif
+#endif
+
+// Patterns per work-stealing chunk - big enough to amortize the atomic add,
+// small enough to balance the load.
+const uint64_t kChunkSize = 1 << 16;
+// How many examples of each kind of failure each thread records.
+const size_t kMaxExamples = 4;
+
+float FloatFromBits(uint32_t bits) {
+  return ulps::FloatTraits<float>::FromBits(bits);
+}
+
+uint32_t BitsFromFloat(float f) {
+  return ulps::FloatTraits<float>::ToBits(f);
+}
+
+// Per-thread results for -compare mode.
+struct alignas(64) CompareResults {
+  uint64_t pairs = 0;
+  // Disagreements between AlmostEqual2sComplement and AlmostEqualUlpsFinal
+  // that are explained by the documented INFINITYCHECK, NANCHECK and
+  // SIGNCHECK differences.
+  uint64_t nanDifferences = 0;
+  uint64_t infinityDifferences = 0;
+  uint64_t signDifferences = 0;
+  // Disagreements that are not explained by those checks.
+  uint64_t unexpected = 0;
+  // Disagreements between AlmostEqualUlpsFinal and ulps::AlmostEqualUlps,
+  // which should never happen.
+  uint64_t templateMismatches = 0;
+  std::vector<std::pair<float, float>> examples;
+};
+
+void SweepCompare(uint64_t first, uint64_t last, int maxUlps, int radius,
+                  unsigned threadCount) {
+  printf("Comparing every float from 0x%08llX to 0x%08llX with its neighbours "
+         "up to %d ulps away, maxUlps = %d.\n",
+         (unsigned long long)first, (unsigned long long)last, radius, maxUlps);
+  std::vector<CompareResults> results(threadCount);
+
+  ParallelSweep(first, last + 1, kChunkSize, threadCount,
+                [&](unsigned thread, uint64_t begin, uint64_t end) {
+    CompareResults& r = results[thread];
+    for (uint64_t bits = begin; bits < end; ++bits) {
+      float A = FloatFromBits(uint32_t(bits));
+      // Walk through the neighbours in float order, which crosses from the
+      // smallest positive denormals to the smallest negative denormals.
+      int64_t key = ulps::OrderedKey(A);
+      for (int offset = -radius; offset <= radius; ++offset) {
+        int64_t neighbourKey = key + offset;
+        // OrderedKey produces 1 to 0xFFFFFFFF.
+        if (neighbourKey < 1 || neighbourKey > 0xFFFFFFFF)
+          continue;
+        float B = ulps::FromOrderedKey<float>(uint32_t(neighbourKey));
+        ++r.pairs;
+
+        bool result2s = AlmostEqual2sComplement(A, B, maxUlps);
+        bool resultFinal = AlmostEqualUlpsFinal(A, B, maxUlps);
+        if (ulps::AlmostEqualUlps(A, B, maxUlps) != resultFinal) {
+          ++r.templateMismatches;
+          if (r.examples.size() < kMaxExamples)
+            r.examples.push_back({A, B});
+        }
+        if (result2s == resultFinal)
+          continue;
+        // Attribute the difference to the first check in
+        // AlmostEqualUlpsFinal that could explain it.
+        if (IsInfinite(A) || IsInfinite(B))
+          ++r.infinityDifferences;
+        else if (IsNan(A) || IsNan(B))
+          ++r.nanDifferences;
+        else if (Sign(A) != Sign(B))
+          ++r.signDifferences;
+        else {
+          ++r.unexpected;
+          if (r.examples.size() < kMaxExamples)
+            r.examples.push_back({A, B});
+        }
+      }
+    }
+  });
+
+  CompareResults total;
+  for (const auto& r : results) {
+    total.pairs += r.pairs;
+    total.nanDifferences += r.nanDifferences;
+    total.infinityDifferences += r.infinityDifferences;
+    total.signDifferences += r.signDifferences;
+    total.unexpected += r.unexpected;
+    total.templateMismatches += r.templateMismatches;
+    total.examples.insert(total.examples.end(), r.examples.begin(),
+                          r.examples.end());
+  }
+
+  printf("Tested %llu pairs.\n", (unsigned long long)total.pairs);
+  printf("Expected differences: %llu from INFINITYCHECK, %llu from NANCHECK, "
+         "%llu from SIGNCHECK.\n",
+         (unsigned long long)total.infinityDifferences,
+         (unsigned long long)total.nanDifferences,
+         (unsigned long long)total.signDifferences);
+  if (total.unexpected || total.templateMismatches) {
+    printf("Unexpected differences: %llu, template mismatches: %llu.\n",
+           (unsigned long long)total.unexpected,
+           (unsigned long long)total.templateMismatches);
+    for (const auto& example : total.examples)
+      printf("  %1.9g (0x%08X), %1.9g (0x%08X)\n", example.first,
+             BitsFromFloat(example.first), example.second,
+             BitsFromFloat(example.second));
+  } else {
+    printf("No unexpected differences.\n");
+  }
+}
+
+#ifdef HAVE_SSE41_FLOOR
+// floorf implemented with roundss, which is what an /arch:AVX floorf boils
+// down to. See arch_avx for why you can end up calling this version even when
+// you didn't ask for it.
+TARGET_SSE41
+float FloorSSE41(float x) {
+  __m128 v = _mm_set_ss(x);
+  return _mm_cvtss_f32(_mm_round_ss(v, v, _MM_FROUND_FLOOR | _MM_FROUND_NO_EXC));
+}
+#endif
+
+struct SweepFunction {
+  const char* name;
+  float (*function)(float);
+  // The reference is evaluated in double precision and then rounded to float.
+  double (*reference)(double);
+};
+
+const SweepFunction kFunctions[] = {
+    {"floorf", [](float x) { return floorf(x); },
+     [](double x) { return floor(x); }},
+#ifdef HAVE_SSE41_FLOOR
+    {"floorf_sse41", FloorSSE41, [](double x) { return floor(x); }},
+#endif
+    {"ceilf", [](float x) { return ceilf(x); },
+     [](double x) { return ceil(x); }},
+    {"truncf", [](float x) { return truncf(x); },
+     [](double x) { return trunc(x); }},
+    {"roundf", [](float x) { return roundf(x); },
+     [](double x) { return round(x); }},
+    {"sqrtf", [](float x) { return sqrtf(x); },
+     [](double x) { return sqrt(x); }},
+    {"expf", [](float x) { return expf(x); }, [](double x) { return exp(x); }},
+    {"logf", [](float x) { return logf(x); }, [](double x) { return log(x); }},
+    {"sinf", [](float x) { return sinf(x); }, [](double x) { return sin(x); }},
+    {"cosf", [](float x) { return cosf(x); }, [](double x) { return cos(x); }},
+};
+
+// Per-thread results for -function mode.
+struct alignas(64) FunctionResults {
+  uint32_t maxUlps = 0;
+  uint32_t worstInput = 0;
+  uint64_t inexact = 0;
+  // Results that were a NAN when the reference wasn't, or vice-versa.
+  uint64_t nanMismatches = 0;
+};
+
+void SweepFunctionError(const SweepFunction& function, uint64_t first,
+                        uint64_t last, unsigned threadCount) {
+  printf("Measuring the error of %s from 0x%08llX to 0x%08llX.\n",
+         function.name, (unsigned long long)first, (unsigned long long)last);
+  std::vector<FunctionResults> results(threadCount);
+
+  ParallelSweep(first, last + 1, kChunkSize, threadCount,
+                [&](unsigned thread, uint64_t begin, uint64_t end) {
+    FunctionResults& r = results[thread];
+    for (uint64_t bits = begin; bits < end; ++bits) {
+      float x = FloatFromBits(uint32_t(bits));
+      float result = function.function(x);
+      float expected = float(function.reference(x));
+      // Identical NANs are not interesting - any NAN result is correct if
+      // the reference is also a NAN.
+      if (isnan(result) && isnan(expected))
+        continue;
+      uint32_t dist = ulps::UlpDistance<float, ulps::kNanCheck>(result, expected);
+      if (dist == 0)
+        continue;
+      ++r.inexact;
+      if (dist == ulps::kIncomparable<float>) {
+        ++r.nanMismatches;
+        continue;
+      }
+      if (dist > r.maxUlps) {
+        r.maxUlps = dist;
+        r.worstInput = uint32_t(bits);
+      }
+    }
+  });
+
+  FunctionResults total;
+  for (const auto& r : results) {
+    total.inexact += r.inexact;
+    total.nanMismatches += r.nanMismatches;
+    if (r.maxUlps > total.maxUlps ||
+        (r.maxUlps == total.maxUlps && r.worstInput < total.worstInput)) {
+      total.maxUlps = r.maxUlps;
+      total.worstInput = r.worstInput;
+    }
+  }
+
+  printf("%llu results differed from the reference, %llu of them NAN "
+         "mismatches.\n",
+         (unsigned long long)total.inexact,
+         (unsigned long long)total.nanMismatches);
+  if (total.maxUlps) {
+    float x = FloatFromBits(total.worstInput);
+    printf("Maximum error was %u ulps, for %1.9g (0x%08X): %1.9g instead of "
+           "%1.9g.\n",
+           total.maxUlps, x, total.worstInput, function.function(x),
+           float(function.reference(x)));
+  } else {
+    printf("Maximum error was 0 ulps.\n");
+  }
+}
+
+void PrintUsage() {
+  printf("Usage:\n");
+  printf("  FloatSweep -compare [-maxulps N] [-radius N] [-threads N] "
+         "[-range first last]\n");
+  printf("  FloatSweep -function name [-threads N] [-range first last]\n");
+  printf("The range is inclusive and in hex, and defaults to all floats.\n");
+  printf("Functions are:");
+  for (const auto& function : kFunctions)
+    printf(" %s", function.name);
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  bool compare = false;
+  const SweepFunction *function = nullptr;
+  int maxUlps = 1;
+  // By default look far enough to see both sides of the maxUlps boundary.
+  int radius = -1;
+  unsigned threadCount = DefaultSweepThreads();
+  uint64_t first = 0;
+  uint64_t last = 0xFFFFFFFF;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (strcmp(arg, "-compare") == 0) {
+      compare = true;
+    } else if (strcmp(arg, "-function") == 0 && hasValue) {
+      const char *name = argv[++i];
+      for (const auto& candidate : kFunctions)
+        if (strcmp(candidate.name, name) == 0)
+          function = &candidate;
+      if (!function) {
+        printf("Unknown function \"%s\".\n", name);
+        PrintUsage();
+        return 1;
+      }
+    } else if (strcmp(arg, "-maxulps") == 0 && hasValue) {
+      maxUlps = atoi(argv[++i]);
+    } else if (strcmp(arg, "-radius") == 0 && hasValue) {
+      radius = atoi(argv[++i]);
+    } else if (strcmp(arg, "-threads") == 0 && hasValue) {
+      threadCount = unsigned(atoi(argv[++i]));
+    } else if (strcmp(arg, "-range") == 0 && i + 2 < argc) {
+      first = strtoull(argv[++i], nullptr, 16);
+      last = strtoull(argv[++i], nullptr, 16);
+    } else {
+      PrintUsage();
+      return 1;
+    }
+  }
+  if (compare == (function != nullptr) || maxUlps < 0 || threadCount == 0 ||
+      first > last || last > 0xFFFFFFFF) {
+    PrintUsage();
+    return 1;
+  }
+  if (radius < 0)
+    radius = maxUlps + 1;
+
+  printf("Using %u threads.\n", threadCount);
+  auto start = std::chrono::steady_clock::now();
+  if (compare)
+    SweepCompare(first, last, maxUlps, radius, threadCount);
+  else
+    SweepFunctionError(*function, first, last, threadCount);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("Sweep took %1.3f s.\n", elapsed.count());
+  return 0;
+}
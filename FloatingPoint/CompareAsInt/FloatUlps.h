@@ -0,0 +1,242 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+FloatUlps.h - header-only, constexpr versions of AlmostEqualUlpsFinal for
+double, float, half (binary16) and bfloat16.
+
+The representations are read with std::bit_cast instead of *(int *)&A so
+the functions are well defined and can be evaluated at compile time. The
+INFINITYCHECK, NANCHECK and SIGNCHECK macros from CompareAsInt.cpp become a
+template parameter so each caller pays only for the checks that it asks for,
+and the checks are written as selects rather than early-outs so that the
+compiler can generate branch-free code.
+
+Requires C++20.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include <bit>
+#include <type_traits>
+#if __has_include(<stdfloat>)
+#include <stdfloat>
+#endif
+
+namespace ulps {
+
+// Flags for the Checks template parameter. These match the INFINITYCHECK,
+// NANCHECK and SIGNCHECK options of AlmostEqualUlpsFinal.
+enum Checks : unsigned {
+  kNoChecks = 0,
+  // Infinities only equal themselves, rather than being 'close' to the
+  // largest finite numbers.
+  kInfinityCheck = 1,
+  // NANs never equal anything, not even themselves.
+  kNanCheck = 2,
+  // Numbers of opposite signs never equal each other, except for +0 and -0.
+  kSignCheck = 4,
+  kAllChecks = kInfinityCheck | kNanCheck | kSignCheck,
+};
+
+// binary16 and bfloat16 values, stored as their raw bits. Many compilers have
+// no arithmetic type for these so they are only containers for comparisons.
+struct Half {
+  uint16_t bits;
+};
+struct BFloat16 {
+  uint16_t bits;
+};
+
+// Describes the layout of each supported type and how to get at its bits.
+template <typename T>
+struct FloatTraits;
+
+template <>
+struct FloatTraits<double> {
+  using Bits = uint64_t;
+  static constexpr int kMantissaBits = 52;
+  static constexpr Bits ToBits(double f) { return std::bit_cast<Bits>(f); }
+  static constexpr double FromBits(Bits b) { return std::bit_cast<double>(b); }
+};
+
+template <>
+struct FloatTraits<float> {
+  using Bits = uint32_t;
+  static constexpr int kMantissaBits = 23;
+  static constexpr Bits ToBits(float f) { return std::bit_cast<Bits>(f); }
+  static constexpr float FromBits(Bits b) { return std::bit_cast<float>(b); }
+};
+
+template <>
+struct FloatTraits<Half> {
+  using Bits = uint16_t;
+  static constexpr int kMantissaBits = 10;
+  static constexpr Bits ToBits(Half f) { return f.bits; }
+  static constexpr Half FromBits(Bits b) { return Half{b}; }
+};
+
+template <>
+struct FloatTraits<BFloat16> {
+  using Bits = uint16_t;
+  static constexpr int kMantissaBits = 7;
+  static constexpr Bits ToBits(BFloat16 f) { return f.bits; }
+  static constexpr BFloat16 FromBits(Bits b) { return BFloat16{b}; }
+};
+
+// The C++23 extended floating-point types, where the compiler has them.
+#ifdef __STDCPP_FLOAT16_T__
+template <>
+struct FloatTraits<std::float16_t> {
+  using Bits = uint16_t;
+  static constexpr int kMantissaBits = 10;
+  static constexpr Bits ToBits(std::float16_t f) {
+    return std::bit_cast<Bits>(f);
+  }
+  static constexpr std::float16_t FromBits(Bits b) {
+    return std::bit_cast<std::float16_t>(b);
+  }
+};
+#endif
+
+#ifdef __STDCPP_BFLOAT16_T__
+template <>
+struct FloatTraits<std::bfloat16_t> {
+  using Bits = uint16_t;
+  static constexpr int kMantissaBits = 7;
+  static constexpr Bits ToBits(std::bfloat16_t f) {
+    return std::bit_cast<Bits>(f);
+  }
+  static constexpr std::bfloat16_t FromBits(Bits b) {
+    return std::bit_cast<std::bfloat16_t>(b);
+  }
+};
+#endif
+
+// Masks derived from the layout. The exponent fills the bits between the
+// mantissa and the sign bit.
+template <typename T>
+struct FloatMasks {
+  using Bits = typename FloatTraits<T>::Bits;
+  static constexpr Bits kSignBit = Bits(Bits(1) << (sizeof(Bits) * 8 - 1));
+  static constexpr Bits kAbsMask = Bits(kSignBit - 1);
+  static constexpr Bits kInfBits =
+      Bits(kAbsMask & ~((Bits(1) << FloatTraits<T>::kMantissaBits) - 1));
+};
+
+// The distance returned by UlpDistance for pairs which the enabled checks
+// say can never be equal.
+template <typename T>
+constexpr typename FloatTraits<T>::Bits kIncomparable =
+    typename FloatTraits<T>::Bits(~typename FloatTraits<T>::Bits(0));
+
+// Maps a float's representation to an unsigned integer that sorts in the same
+// order as the float. This is the 0x80000000 - aInt trick from
+// AlmostEqual2sComplement, offset by the sign bit so that it can be done with
+// unsigned math. +0 and -0 both map to the sign bit.
+template <typename T>
+constexpr typename FloatTraits<T>::Bits OrderedKey(T A) {
+  using Bits = typename FloatTraits<T>::Bits;
+  using Masks = FloatMasks<T>;
+  const Bits a = FloatTraits<T>::ToBits(A);
+  const Bits aAbs = a & Masks::kAbsMask;
+  return (a & Masks::kSignBit) ? Bits(Masks::kSignBit - aAbs)
+                               : Bits(Masks::kSignBit + aAbs);
+}
+
+// The inverse of OrderedKey. The sign bit maps back to +0, and zero, which
+// OrderedKey never produces, maps to -0.
+template <typename T>
+constexpr T FromOrderedKey(typename FloatTraits<T>::Bits key) {
+  using Bits = typename FloatTraits<T>::Bits;
+  using Masks = FloatMasks<T>;
+  return FloatTraits<T>::FromBits(
+      (key & Masks::kSignBit) ? Bits(key - Masks::kSignBit)
+                              : Bits(Masks::kSignBit | (Masks::kSignBit - key)));
+}
+
+// Maps a float's representation to an unsigned integer that sorts in the same
+// order as the float, for radix sorting. Unlike OrderedKey this is a
+// bijection: -0 sorts just before +0, and NANs sort below -infinity or above
+// +infinity depending on their sign bit, like the IEEE totalOrder predicate.
+// Negative numbers have all of their bits flipped and positive numbers have
+// just the sign bit flipped, done without branches.
+template <typename T>
+constexpr typename FloatTraits<T>::Bits SortKey(T A) {
+  using Bits = typename FloatTraits<T>::Bits;
+  using Masks = FloatMasks<T>;
+  const Bits a = FloatTraits<T>::ToBits(A);
+  // All ones if the sign bit is set, zero otherwise.
+  const Bits negativeMask = Bits(Bits(0) - (a >> (sizeof(Bits) * 8 - 1)));
+  return Bits(a ^ (negativeMask | Masks::kSignBit));
+}
+
+// The inverse of SortKey.
+template <typename T>
+constexpr T FromSortKey(typename FloatTraits<T>::Bits key) {
+  using Bits = typename FloatTraits<T>::Bits;
+  using Masks = FloatMasks<T>;
+  // Keys without the sign bit set came from negative numbers.
+  const Bits negativeMask = Bits((key >> (sizeof(Bits) * 8 - 1)) - 1);
+  return FloatTraits<T>::FromBits(Bits(key ^ (negativeMask | Masks::kSignBit)));
+}
+
+// Returns how many representable values apart A and B are, or
+// kIncomparable<T> if the checks say they can never be equal. Unlike
+// AlmostEqual2sComplement the distance is calculated with unsigned math so
+// it never wraps around from infinity to -infinity.
+template <typename T, unsigned Checks = kAllChecks>
+constexpr typename FloatTraits<T>::Bits UlpDistance(T A, T B) {
+  using Bits = typename FloatTraits<T>::Bits;
+  using Masks = FloatMasks<T>;
+  const Bits a = FloatTraits<T>::ToBits(A);
+  const Bits b = FloatTraits<T>::ToBits(B);
+  const Bits aAbs = a & Masks::kAbsMask;
+  const Bits bAbs = b & Masks::kAbsMask;
+  const Bits aKey = OrderedKey(A);
+  const Bits bKey = OrderedKey(B);
+  Bits result = aKey > bKey ? Bits(aKey - bKey) : Bits(bKey - aKey);
+
+  // The checks are applied in the reverse of the order used in
+  // AlmostEqualUlpsFinal so that the first one that applies has the last
+  // word. Non-short-circuiting operators keep these as selects.
+  if constexpr ((Checks & kSignCheck) != 0) {
+    const bool signsDiffer = ((a ^ b) & Masks::kSignBit) != 0;
+    const bool bothZero = (aAbs | bAbs) == 0;
+    result = signsDiffer ? (bothZero ? Bits(0) : kIncomparable<T>) : result;
+  }
+  if constexpr ((Checks & kNanCheck) != 0) {
+    const bool eitherNan = (aAbs > Masks::kInfBits) | (bAbs > Masks::kInfBits);
+    result = eitherNan ? kIncomparable<T> : result;
+  }
+  if constexpr ((Checks & kInfinityCheck) != 0) {
+    const bool eitherInf =
+        (aAbs == Masks::kInfBits) | (bAbs == Masks::kInfBits);
+    result = eitherInf ? (a == b ? Bits(0) : kIncomparable<T>) : result;
+  }
+  return result;
+}
+
+// Templated AlmostEqualUlpsFinal. maxUlps must be less than kIncomparable<T>.
+template <typename T, unsigned Checks = kAllChecks>
+constexpr bool AlmostEqualUlps(T A, T B,
+                               typename FloatTraits<T>::Bits maxUlps) {
+  return UlpDistance<T, Checks>(A, B) <= maxUlps;
+}
+
+}  // namespace ulps
@@ -0,0 +1,95 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+ParallelSweep.h - run a function over a large integer range on all cores.
+
+The range is split evenly between the threads, and each thread claims
+fixed-size chunks from the front of its own share. When a thread runs out it
+steals chunks from the other threads' shares, so threads that were handed
+slow parts of the range (denormals, NANs, expensive math-library paths)
+don't hold up the whole sweep. Claiming a chunk is a single atomic add, and
+since owners and thieves claim from the same counter no chunk is ever
+processed twice.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Returns the number of threads to use when the caller doesn't specify.
+inline unsigned DefaultSweepThreads() {
+  unsigned threads = std::thread::hardware_concurrency();
+  return threads ? threads : 1;
+}
+
+// Calls fn(threadIndex, chunkBegin, chunkEnd) for chunks that exactly cover
+// [begin, end). Calls with the same threadIndex are made from the same
+// thread, one at a time, so fn can accumulate results per thread without
+// locking.
+template <typename Fn>
+void ParallelSweep(uint64_t begin, uint64_t end, uint64_t chunkSize,
+                   unsigned threadCount, Fn fn) {
+  if (end <= begin)
+    return;
+  if (threadCount == 0)
+    threadCount = 1;
+  if (chunkSize == 0)
+    chunkSize = 1;
+
+  // Each share is on its own cache line so that claiming chunks doesn't
+  // cause false sharing.
+  struct alignas(64) Share {
+    std::atomic<uint64_t> next;
+    uint64_t end;
+  };
+  std::unique_ptr<Share[]> shares(new Share[threadCount]);
+  const uint64_t total = end - begin;
+  for (unsigned i = 0; i < threadCount; ++i) {
+    shares[i].next = begin + total / threadCount * i;
+    shares[i].end = i + 1 == threadCount
+                        ? end
+                        : begin + total / threadCount * (i + 1);
+  }
+
+  auto worker = [&](unsigned threadIndex) {
+    // Start with our own share and then move on to our neighbours'.
+    for (unsigned n = 0; n < threadCount; ++n) {
+      Share& share = shares[(threadIndex + n) % threadCount];
+      for (;;) {
+        uint64_t chunkBegin = share.next.fetch_add(chunkSize);
+        if (chunkBegin >= share.end)
+          break;
+        uint64_t chunkEnd = share.end - chunkBegin < chunkSize
+                                ? share.end
+                                : chunkBegin + chunkSize;
+        fn(threadIndex, chunkBegin, chunkEnd);
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < threadCount; ++i)
+    threads.emplace_back(worker, i);
+  worker(0);
+  for (auto& thread : threads)
+    thread.join();
+}
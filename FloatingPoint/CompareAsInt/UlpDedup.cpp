@@ -0,0 +1,174 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+UlpDedup.cpp - checks that UlpHashIndex deduplicates exactly the same way as
+the O(n^2) loop of AlmostEqualUlpsFinal calls that it replaces, and times
+both.
+
+Usage:
+  UlpDedup [count] [-maxulps N]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "CompareAsInt.h"
+#include "UlpHashIndex.h"
+
+using Vertex = std::array<float, 3>;
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Makes mesh-like vertex data where most vertices are shared by several
+// triangles, but the copies have picked up a few ulps of error along the way.
+// Some vertices sit near zero and some are infinities or NANs, to exercise
+// the sign, infinity and NAN rules.
+std::vector<Vertex> MakeVertices(size_t count, int maxUlps) {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+  std::uniform_int_distribution<int> jitter(-maxUlps - 1, maxUlps + 1);
+  std::vector<Vertex> vertices(count);
+  for (size_t i = 0; i < count; ++i) {
+    Vertex& v = vertices[i];
+    if (i > 0 && rng() % 4 != 0) {
+      // A copy of an earlier vertex with some integer-representation noise.
+      v = vertices[rng() % i];
+      for (float& f : v)
+        (*(int *)&f) += jitter(rng);
+    } else {
+      for (float& f : v)
+        f = position(rng);
+    }
+    switch (rng() % 64) {
+    case 0:
+      v[0] = rng() % 2 ? 0.0f : -0.0f;
+      break;
+    case 1:
+      v[1] = rng() % 2 ? INFINITY : -INFINITY;
+      break;
+    case 2:
+      v[2] = NAN;
+      break;
+    }
+  }
+  return vertices;
+}
+
+bool VerticesEqual(const Vertex& a, const Vertex& b, int maxUlps) {
+  return AlmostEqualUlpsFinal(a[0], b[0], maxUlps) &&
+         AlmostEqualUlpsFinal(a[1], b[1], maxUlps) &&
+         AlmostEqualUlpsFinal(a[2], b[2], maxUlps);
+}
+
+// The straightforward way - compare each vertex with every kept vertex.
+std::vector<uint32_t> DedupPairwise(const std::vector<Vertex>& vertices,
+                                    int maxUlps, size_t *uniqueCount) {
+  std::vector<Vertex> unique;
+  std::vector<uint32_t> remap(vertices.size());
+  for (size_t i = 0; i < vertices.size(); ++i) {
+    size_t j = 0;
+    while (j < unique.size() && !VerticesEqual(unique[j], vertices[i], maxUlps))
+      ++j;
+    if (j == unique.size())
+      unique.push_back(vertices[i]);
+    remap[i] = uint32_t(j);
+  }
+  *uniqueCount = unique.size();
+  return remap;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = 1000 * 1000;
+  int maxUlps = 4;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-maxulps") == 0 && i + 1 < argc)
+      maxUlps = atoi(argv[++i]);
+    else
+      count = size_t(strtoull(argv[i], nullptr, 10));
+  }
+  if (maxUlps < 0) {
+    printf("Usage: UlpDedup [count] [-maxulps N]\n");
+    return 1;
+  }
+
+  // The pairwise version is too slow to run on the full set.
+  const size_t pairwiseCount = count < 20000 ? count : 20000;
+  const std::vector<Vertex> vertices = MakeVertices(count, maxUlps);
+
+  auto start = std::chrono::steady_clock::now();
+  size_t pairwiseUnique = 0;
+  std::vector<uint32_t> expected =
+      DedupPairwise(std::vector<Vertex>(vertices.begin(),
+                                        vertices.begin() + pairwiseCount),
+                    maxUlps, &pairwiseUnique);
+  double pairwiseTime = SecondsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  DedupResult<3> small = DeduplicateUlps(vertices.data(), pairwiseCount, maxUlps);
+  double smallTime = SecondsSince(start);
+
+  bool success = small.unique.size() == pairwiseUnique;
+  for (size_t i = 0; i < pairwiseCount && success; ++i) {
+    if (small.remap[i] != expected[i]) {
+      printf("Unexpected result dedup - vertex %zu mapped to %u instead of "
+             "%u.\n",
+             i, small.remap[i], expected[i]);
+      success = false;
+    }
+  }
+  printf("%zu vertices -> %zu unique: pairwise %1.3f s, hash index %1.3f s.\n",
+         pairwiseCount, small.unique.size(), pairwiseTime, smallTime);
+
+  start = std::chrono::steady_clock::now();
+  DedupResult<3> full = DeduplicateUlps(vertices.data(), count, maxUlps);
+  printf("%zu vertices -> %zu unique: hash index %1.3f s.\n", count,
+         full.unique.size(), SecondsSince(start));
+
+  // Joining the unique vertices back against the input should find every
+  // input vertex's representative.
+  size_t joinedPairs = 0;
+  size_t missing = count;
+  start = std::chrono::steady_clock::now();
+  JoinUlps(full.unique.data(), full.unique.size(), vertices.data(), count,
+           maxUlps, [&](size_t u, size_t v) {
+             ++joinedPairs;
+             if (full.remap[v] == u)
+               --missing;
+           });
+  printf("Join found %zu matching pairs in %1.3f s.\n", joinedPairs,
+         SecondsSince(start));
+  // NANs never match anything, not even their own representatives.
+  size_t nanVertices = 0;
+  for (const Vertex& v : vertices)
+    nanVertices += v[0] != v[0] || v[1] != v[1] || v[2] != v[2];
+  if (missing != nanVertices) {
+    printf("Unexpected result join - %zu vertices did not find their "
+           "representative, expected %zu.\n",
+           missing, nanVertices);
+    success = false;
+  }
+  return success ? 0 : 1;
+}
@@ -0,0 +1,378 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+UlpDiff.cpp - compare two binary files full of floats using the
+AlmostEqualUlpsFinal rules, and report how far apart they are.
+
+The files are never loaded into memory. Each thread maps a fixed-size window
+of both files, compares it with AlmostEqualUlpsBulk, and unmaps it again, so
+memory usage depends only on the window size and thread count and not on
+the file size. Windows where every pair is bit-identical (the common case
+when diffing releases) skip the per-element histogram pass entirely.
+
+Usage:
+  UlpDiff fileA fileB [-maxulps N] [-threads N] [-window MiB] [-worst N]
+
+Prints a histogram of ULP distances, the offsets of the worst pairs, and
+PASS or FAIL depending on whether every pair was within maxUlps. The exit
+code is 0 for PASS, 1 for FAIL and 2 for errors.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "BulkCompare.h"
+#include "ParallelSweep.h"
+
+// Bucket 0 is for identical values, bucket n (1 to 31) is for distances from
+// 2^(n-1) to 2^n - 1, and the last bucket is for incomparable pairs.
+const int kNumBuckets = 33;
+const int kIncomparableBucket = kNumBuckets - 1;
+
+// A read-only file which can have windows of it mapped into memory.
+class MappedFile {
+public:
+  ~MappedFile() {
+#ifdef _WIN32
+    if (mapping_)
+      CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE)
+      CloseHandle(file_);
+#else
+    if (fd_ >= 0)
+      close(fd_);
+#endif
+  }
+
+  bool Open(const char *name) {
+#ifdef _WIN32
+    file_ = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+      return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size))
+      return false;
+    size_ = uint64_t(size.QuadPart);
+    // Empty files can't be mapped, but then there is nothing to map.
+    if (size_) {
+      mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0,
+                                    nullptr);
+      if (!mapping_)
+        return false;
+    }
+#else
+    fd_ = open(name, O_RDONLY);
+    if (fd_ < 0)
+      return false;
+    struct stat info;
+    if (fstat(fd_, &info) != 0)
+      return false;
+    size_ = uint64_t(info.st_size);
+#endif
+    return true;
+  }
+
+  uint64_t Size() const { return size_; }
+
+  // Maps [offset, offset + length). offset must be a multiple of
+  // WindowAlignment().
+  const void *Map(uint64_t offset, size_t length) const {
+#ifdef _WIN32
+    return MapViewOfFile(mapping_, FILE_MAP_READ, DWORD(offset >> 32),
+                         DWORD(offset), length);
+#else
+    void *p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd_, off_t(offset));
+    if (p == MAP_FAILED)
+      return nullptr;
+    // Each window is read once from start to finish.
+    madvise(p, length, MADV_SEQUENTIAL);
+    return p;
+#endif
+  }
+
+  static void Unmap(const void *p, size_t length) {
+#ifdef _WIN32
+    (void)length;
+    UnmapViewOfFile(p);
+#else
+    munmap(const_cast<void *>(p), length);
+#endif
+  }
+
+  static size_t WindowAlignment() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+#else
+    return size_t(sysconf(_SC_PAGESIZE));
+#endif
+  }
+
+private:
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+  uint64_t size_ = 0;
+};
+
+// A pair that differs, identified by its element index.
+struct Difference {
+  uint32_t ulps;
+  uint64_t index;
+  float a;
+  float b;
+};
+
+// Orders differences so that the top of a priority_queue is the least bad,
+// which makes it easy to keep only the worst N. Ties are broken in favor of
+// the lowest index so that the results don't depend on thread timing.
+bool LessBad(const Difference& lhs, const Difference& rhs) {
+  if (lhs.ulps != rhs.ulps)
+    return lhs.ulps < rhs.ulps;
+  return lhs.index > rhs.index;
+}
+bool MoreBad(const Difference& lhs, const Difference& rhs) {
+  return LessBad(rhs, lhs);
+}
+
+using WorstList =
+    std::priority_queue<Difference, std::vector<Difference>,
+                        std::function<bool(const Difference&, const Difference&)>>;
+
+// Per-thread results.
+struct alignas(64) DiffResults {
+  uint64_t histogram[kNumBuckets] = {};
+  uint64_t matchCount = 0;
+  uint64_t firstMismatch = UINT64_MAX;
+  uint32_t maxUlps = 0;
+  WorstList worst{MoreBad};
+  bool mapFailed = false;
+};
+
+int Bucket(uint32_t ulps) {
+  if (ulps == kUlpsIncomparable)
+    return kIncomparableBucket;
+  return int(std::bit_width(ulps));
+}
+
+void PrintUsage() {
+  printf("Usage: UlpDiff fileA fileB [-maxulps N] [-threads N] [-window MiB] "
+         "[-worst N]\n");
+  printf("Compares two files of 32-bit floats using the AlmostEqualUlpsFinal "
+         "rules.\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *names[2] = {};
+  int maxUlps = 0;
+  unsigned threadCount = DefaultSweepThreads();
+  size_t windowMiB = 16;
+  size_t worstCount = 10;
+  int nameCount = 0;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (strcmp(arg, "-maxulps") == 0 && hasValue)
+      maxUlps = atoi(argv[++i]);
+    else if (strcmp(arg, "-threads") == 0 && hasValue)
+      threadCount = unsigned(atoi(argv[++i]));
+    else if (strcmp(arg, "-window") == 0 && hasValue)
+      windowMiB = size_t(atoi(argv[++i]));
+    else if (strcmp(arg, "-worst") == 0 && hasValue)
+      worstCount = size_t(atoi(argv[++i]));
+    else if (arg[0] != '-' && nameCount < 2)
+      names[nameCount++] = arg;
+    else {
+      PrintUsage();
+      return 2;
+    }
+  }
+  if (nameCount != 2 || maxUlps < 0 || threadCount == 0 || windowMiB == 0) {
+    PrintUsage();
+    return 2;
+  }
+
+  MappedFile files[2];
+  for (int i = 0; i < 2; ++i) {
+    if (!files[i].Open(names[i])) {
+      printf("Failed to open %s.\n", names[i]);
+      return 2;
+    }
+  }
+
+  bool sizesMatch = files[0].Size() == files[1].Size();
+  if (!sizesMatch)
+    printf("File sizes differ (%llu and %llu bytes), comparing the common "
+           "prefix.\n",
+           (unsigned long long)files[0].Size(),
+           (unsigned long long)files[1].Size());
+  const uint64_t commonSize = std::min(files[0].Size(), files[1].Size());
+  if (commonSize % sizeof(float))
+    printf("Ignoring %d trailing bytes that don't make up a float.\n",
+           int(commonSize % sizeof(float)));
+  const uint64_t count = commonSize / sizeof(float);
+
+  // Whole MiB windows are always suitably aligned for mapping.
+  const size_t windowBytes = windowMiB * 1024 * 1024;
+  if (windowBytes % MappedFile::WindowAlignment()) {
+    printf("Window size must be a multiple of %zu bytes.\n",
+           MappedFile::WindowAlignment());
+    return 2;
+  }
+  const uint64_t windowFloats = windowBytes / sizeof(float);
+  const uint64_t windowCount = (count + windowFloats - 1) / windowFloats;
+
+  printf("Comparing %llu floats using %u threads and %zu MiB windows, "
+         "maxUlps = %d.\n",
+         (unsigned long long)count, threadCount, windowMiB, maxUlps);
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<DiffResults> results(threadCount);
+  ParallelSweep(0, windowCount, 1, threadCount,
+                [&](unsigned thread, uint64_t window, uint64_t) {
+    DiffResults& r = results[thread];
+    const uint64_t first = window * windowFloats;
+    const size_t n = size_t(std::min(windowFloats, count - first));
+    const size_t bytes = n * sizeof(float);
+    const float *A =
+        static_cast<const float *>(files[0].Map(first * sizeof(float), bytes));
+    const float *B =
+        static_cast<const float *>(files[1].Map(first * sizeof(float), bytes));
+    if (A && B) {
+      BulkCompareResult bulk = AlmostEqualUlpsBulk(A, B, n, maxUlps);
+      r.matchCount += bulk.matchCount;
+      if (bulk.firstMismatch != n)
+        r.firstMismatch = std::min(r.firstMismatch, first + bulk.firstMismatch);
+      r.maxUlps = std::max(r.maxUlps, bulk.maxUlps);
+      if (bulk.maxUlps == 0) {
+        // Everything is identical so the histogram pass can be skipped.
+        r.histogram[0] += n;
+      } else {
+        for (size_t i = 0; i < n; ++i) {
+          uint32_t ulps = UlpDistanceFinal(A[i], B[i]);
+          ++r.histogram[Bucket(ulps)];
+          if (ulps == 0 || worstCount == 0)
+            continue;
+          Difference diff = {ulps, first + i, A[i], B[i]};
+          if (r.worst.size() < worstCount) {
+            r.worst.push(diff);
+          } else if (MoreBad(diff, r.worst.top())) {
+            r.worst.pop();
+            r.worst.push(diff);
+          }
+        }
+      }
+    } else {
+      r.mapFailed = true;
+    }
+    if (A)
+      MappedFile::Unmap(A, bytes);
+    if (B)
+      MappedFile::Unmap(B, bytes);
+  });
+
+  DiffResults total;
+  std::vector<Difference> worst;
+  for (auto& r : results) {
+    for (int i = 0; i < kNumBuckets; ++i)
+      total.histogram[i] += r.histogram[i];
+    total.matchCount += r.matchCount;
+    total.firstMismatch = std::min(total.firstMismatch, r.firstMismatch);
+    total.maxUlps = std::max(total.maxUlps, r.maxUlps);
+    total.mapFailed |= r.mapFailed;
+    for (; !r.worst.empty(); r.worst.pop())
+      worst.push_back(r.worst.top());
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  if (total.mapFailed) {
+    printf("Failed to map the files.\n");
+    return 2;
+  }
+
+  printf("Compared %1.1f MiB in %1.3f s (%1.1f MiB/s).\n",
+         commonSize / (1024.0 * 1024.0), elapsed.count(),
+         commonSize / (1024.0 * 1024.0) / elapsed.count());
+  printf("\nULP distance histogram:\n");
+  for (int i = 0; i < kNumBuckets; ++i) {
+    if (!total.histogram[i])
+      continue;
+    double percent = 100.0 * total.histogram[i] / count;
+    if (i == 0)
+      printf("  %23s: %12llu (%7.3f%%)\n", "0",
+             (unsigned long long)total.histogram[i], percent);
+    else if (i == kIncomparableBucket)
+      printf("  %23s: %12llu (%7.3f%%)\n", "incomparable",
+             (unsigned long long)total.histogram[i], percent);
+    else
+      printf("  %10u - %10u: %12llu (%7.3f%%)\n", 1u << (i - 1),
+             (1u << (i - 1)) * 2 - 1, (unsigned long long)total.histogram[i],
+             percent);
+  }
+
+  std::sort(worst.begin(), worst.end(), MoreBad);
+  if (worst.size() > worstCount)
+    worst.resize(worstCount);
+  if (!worst.empty()) {
+    printf("\nWorst differences:\n");
+    for (const auto& diff : worst) {
+      char ulps[20];
+      if (diff.ulps == kUlpsIncomparable)
+        strcpy(ulps, "incomparable");
+      else
+        snprintf(ulps, sizeof(ulps), "%u ulps", diff.ulps);
+      printf("  index %12llu (offset 0x%010llX): %1.9g vs %1.9g, %s\n",
+             (unsigned long long)diff.index,
+             (unsigned long long)(diff.index * sizeof(float)), diff.a, diff.b,
+             ulps);
+    }
+  }
+
+  printf("\n");
+  const bool pass = sizesMatch && total.matchCount == count;
+  if (total.matchCount != count)
+    printf("%llu of %llu floats differ by more than %d ulps, the first at "
+           "index %llu.\n",
+           (unsigned long long)(count - total.matchCount),
+           (unsigned long long)count, maxUlps,
+           (unsigned long long)total.firstMismatch);
+  printf("%s\n", pass ? "PASS" : "FAIL");
+  return pass ? 0 : 1;
+}
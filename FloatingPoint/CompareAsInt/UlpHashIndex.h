@@ -0,0 +1,245 @@
+/*
+   Copyright 2021 Bruce Dawson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+UlpHashIndex.h - a hash index for finding float vectors (mesh vertices,
+sensor samples, etc.) that are equal to within maxUlps in every component,
+in close to constant time per lookup instead of comparing against every
+previous vector.
+
+Each component is converted to its ordered integer with ulps::OrderedKey and
+divided by maxUlps + 1 to get a cell number. Two components that are within
+maxUlps of each other have ordered integers that differ by at most maxUlps,
+so their cells differ by at most one. A lookup therefore only has to check
+the vectors in the 3^Dims neighbouring cells, and each candidate is then
+checked with ulps::AlmostEqualUlps so the equivalence is exactly the same as
+AlmostEqualUlpsFinal's (or the subset of checks chosen by the Checks
+parameter). NANs never equal anything, infinities only equal themselves and
++0 equals -0, just as with the pairwise functions.
+
+Being "within maxUlps" is not transitive, so deduplication maps each vector
+to the *first* previously kept vector that it matches. This gives the same
+answer as the O(n^2) loop over the kept vectors.
+
+The number of cells probed grows as 3^Dims so this is intended for small
+vectors - 27 probes for 3D vertices.
+
+Requires C++20.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <vector>
+
+#include "FloatUlps.h"
+
+template <size_t Dims, unsigned Checks = ulps::kAllChecks>
+class UlpHashIndex {
+public:
+  using Point = std::array<float, Dims>;
+  static constexpr uint32_t kNotFound = UINT32_MAX;
+
+  // maxUlps must be less than ulps::kIncomparable<float>.
+  explicit UlpHashIndex(uint32_t maxUlps, size_t expectedCount = 0)
+      : maxUlps_(maxUlps), cellSize_(uint64_t(maxUlps) + 1) {
+    Rehash(expectedCount * 2 > 16 ? expectedCount * 2 : 16);
+    points_.reserve(expectedCount);
+    next_.reserve(expectedCount);
+  }
+
+  size_t size() const { return points_.size(); }
+  const Point& operator[](size_t index) const { return points_[index]; }
+  const std::vector<Point>& points() const { return points_; }
+
+  // Adds a point, even if there is already a matching one, and returns its
+  // index.
+  uint32_t Insert(const Point& point) {
+    if ((points_.size() + 1) * 2 > slots_.size())
+      Rehash(slots_.size() * 2);
+    const uint32_t index = uint32_t(points_.size());
+    points_.push_back(point);
+    Slot& slot = FindSlot(HashCell(CellOf(point)));
+    next_.push_back(slot.head);
+    slot.head = index;
+    return index;
+  }
+
+  // Calls fn(index) for every inserted point that matches point, in no
+  // particular order.
+  template <typename Fn>
+  void ForEachMatch(const Point& point, Fn fn) const {
+    const Cell center = CellOf(point);
+    // Count through the 3^Dims neighbours in base 3, where digit d selects
+    // an offset of -1, 0 or +1 for dimension d.
+    size_t neighbours = 1;
+    for (size_t d = 0; d < Dims; ++d)
+      neighbours *= 3;
+    for (size_t n = 0; n < neighbours; ++n) {
+      Cell cell = center;
+      bool valid = true;
+      size_t digits = n;
+      for (size_t d = 0; d < Dims; ++d, digits /= 3) {
+        int64_t offset = int64_t(digits % 3) - 1;
+        // Cells off either end of the key range can't contain anything.
+        if ((offset < 0 && cell[d] == 0) || (offset > 0 && cell[d] == kMaxCell))
+          valid = false;
+        cell[d] = uint32_t(cell[d] + offset);
+      }
+      if (!valid)
+        continue;
+      const Slot& slot = FindSlot(HashCell(cell));
+      for (uint32_t i = slot.head; i != kNotFound; i = next_[i]) {
+        if (Matches(points_[i], point))
+          fn(i);
+      }
+    }
+  }
+
+  // Returns the lowest index of a matching point, or kNotFound.
+  uint32_t Find(const Point& point) const {
+    uint32_t found = kNotFound;
+    ForEachMatch(point, [&](uint32_t index) {
+      if (index < found)
+        found = index;
+    });
+    return found;
+  }
+
+  // Returns the index of the first matching point, inserting point if there
+  // isn't one.
+  uint32_t FindOrInsert(const Point& point) {
+    uint32_t found = Find(point);
+    return found != kNotFound ? found : Insert(point);
+  }
+
+private:
+  using Cell = std::array<uint32_t, Dims>;
+  static constexpr uint32_t kMaxCell = UINT32_MAX;
+
+  struct Slot {
+    uint64_t hash;
+    uint32_t head;
+  };
+
+  Cell CellOf(const Point& point) const {
+    Cell cell;
+    for (size_t d = 0; d < Dims; ++d)
+      cell[d] = uint32_t(ulps::OrderedKey(point[d]) / cellSize_);
+    return cell;
+  }
+
+  static uint64_t HashCell(const Cell& cell) {
+    // Different cells with the same hash just produce extra candidates that
+    // fail the AlmostEqualUlps check, so this only needs to mix well.
+    uint64_t hash = 0x9E3779B97F4A7C15ull;
+    for (uint32_t c : cell) {
+      hash = (hash ^ c) * 0xBF58476D1CE4E5B9ull;
+      hash ^= hash >> 31;
+    }
+    return hash;
+  }
+
+  bool Matches(const Point& a, const Point& b) const {
+    for (size_t d = 0; d < Dims; ++d) {
+      if (!ulps::AlmostEqualUlps<float, Checks>(a[d], b[d], maxUlps_))
+        return false;
+    }
+    return true;
+  }
+
+  // Open addressing with linear probing. Returns the slot for hash, which is
+  // empty (head == kNotFound) if the hash isn't in the table.
+  Slot& FindSlot(uint64_t hash) {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = size_t(hash) & mask;; i = (i + 1) & mask) {
+      Slot& slot = slots_[i];
+      if (slot.head == kNotFound) {
+        slot.hash = hash;
+        return slot;
+      }
+      if (slot.hash == hash)
+        return slot;
+    }
+  }
+  const Slot& FindSlot(uint64_t hash) const {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = size_t(hash) & mask;; i = (i + 1) & mask) {
+      const Slot& slot = slots_[i];
+      if (slot.head == kNotFound || slot.hash == hash)
+        return slot;
+    }
+  }
+
+  // Grows the slot table to at least minSlots (rounded up to a power of two)
+  // and relinks every point.
+  void Rehash(size_t minSlots) {
+    size_t slotCount = 16;
+    while (slotCount < minSlots)
+      slotCount *= 2;
+    slots_.assign(slotCount, Slot{0, kNotFound});
+    for (uint32_t i = 0; i < points_.size(); ++i) {
+      Slot& slot = FindSlot(HashCell(CellOf(points_[i])));
+      next_[i] = slot.head;
+      slot.head = i;
+    }
+  }
+
+  uint32_t maxUlps_;
+  uint64_t cellSize_;
+  std::vector<Point> points_;
+  // Chains of points in the same cell, linked by index.
+  std::vector<uint32_t> next_;
+  std::vector<Slot> slots_;
+};
+
+// Results of DeduplicateUlps.
+template <size_t Dims>
+struct DedupResult {
+  // The points that were kept, in the order they first appeared.
+  std::vector<std::array<float, Dims>> unique;
+  // For each input point, the index in unique of the point it matched.
+  std::vector<uint32_t> remap;
+};
+
+// Collapses points that are equal to within maxUlps in every component.
+template <size_t Dims, unsigned Checks = ulps::kAllChecks>
+DedupResult<Dims> DeduplicateUlps(const std::array<float, Dims> *points,
+                                  size_t count, uint32_t maxUlps) {
+  UlpHashIndex<Dims, Checks> index(maxUlps, count);
+  DedupResult<Dims> result;
+  result.remap.resize(count);
+  for (size_t i = 0; i < count; ++i)
+    result.remap[i] = index.FindOrInsert(points[i]);
+  result.unique = index.points();
+  return result;
+}
+
+// Calls fn(aIndex, bIndex) for every pair of points from a and b that are
+// equal to within maxUlps in every component.
+template <size_t Dims, unsigned Checks = ulps::kAllChecks, typename Fn>
+void JoinUlps(const std::array<float, Dims> *a, size_t aCount,
+              const std::array<float, Dims> *b, size_t bCount,
+              uint32_t maxUlps, Fn fn) {
+  UlpHashIndex<Dims, Checks> index(maxUlps, aCount);
+  for (size_t i = 0; i < aCount; ++i)
+    index.Insert(a[i]);
+  for (size_t j = 0; j < bCount; ++j)
+    index.ForEachMatch(b[j], [&](uint32_t i) { fn(size_t(i), j); });
+}
@@ -0,0 +1,12 @@
+@rem Builds the comparison tests, including the SIMD array comparisons.
+cl /nologo /O2 /EHsc /std:c++20 CompareAsInt.cpp BulkCompare.cpp
+@rem Exhaustive sweeps of the comparison functions and of math functions.
+cl /nologo /O2 /EHsc /std:c++20 FloatSweep.cpp
+@rem Memory-mapped ULP diff of two binary float files.
+cl /nologo /O2 /EHsc /std:c++20 UlpDiff.cpp BulkCompare.cpp
+@rem Radix sort tests and benchmarks.
+cl /nologo /O2 /EHsc /std:c++20 FloatSort.cpp
+@rem Near-duplicate detection tests and benchmarks.
+cl /nologo /O2 /EHsc /std:c++20 UlpDedup.cpp
+@rem Branchless comparison benchmarks.
+cl /nologo /O2 /EHsc /std:c++20 CompareBench.cpp
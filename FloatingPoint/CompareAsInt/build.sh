@@ -0,0 +1,15 @@
+#!/bin/sh
+# Builds the comparison tests, including the SIMD array comparisons.
+# CompareAsInt.h reads floats through int pointers, as in the article, so
+# strict aliasing has to be disabled.
+g++ -O2 -std=c++20 -fno-strict-aliasing -o CompareAsInt CompareAsInt.cpp BulkCompare.cpp
+# Exhaustive sweeps of the comparison functions and of math functions.
+g++ -O2 -std=c++20 -fno-strict-aliasing -pthread -o FloatSweep FloatSweep.cpp
+# Memory-mapped ULP diff of two binary float files.
+g++ -O2 -std=c++20 -pthread -o UlpDiff UlpDiff.cpp BulkCompare.cpp
+# Radix sort tests and benchmarks.
+g++ -O2 -std=c++20 -pthread -o FloatSort FloatSort.cpp
+# Near-duplicate detection tests and benchmarks.
+g++ -O2 -std=c++20 -fno-strict-aliasing -o UlpDedup UlpDedup.cpp
+# Branchless comparison benchmarks.
+g++ -O2 -std=c++20 -fno-strict-aliasing -o CompareBench CompareBench.cpp
@@ -0,0 +1,243 @@
+// Measures how long an innocent thread is blocked while processes are being
+// created and destroyed, to find out which kernel locks they contend on. This
+// generalizes the Windows LockChecker thread, which timed PeekMessage to catch
+// UserCrit contention.
+// A probe thread repeats one cheap operation in a tight loop and records every
+// call in a latency histogram, and the worst call in each 10 ms slot in a
+// timeline, so that stalls can be lined up with the phase of the test that
+// caused them. The operations are:
+//   mmap   mmap, touch and munmap a page - our mmap_lock and the page allocator.
+//   proc   read /proc/self/stat - the task and /proc lookup locks.
+//   open   open and close /dev/null - path lookup and the file table.
+//   futex  wake a second thread and wait for it to wake us - the scheduler's
+//          run queues.
+// The probe uses a CPU of its own, so leave one free if the timings of the
+// test itself matter.
+
+#pragma once
+
+#include "../cfg/VAllocStress/LatencyHistogram.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+enum ProbeKind
+{
+	kProbeNone,
+	kProbeMmap,
+	kProbeProc,
+	kProbeOpen,
+	kProbeFutex,
+	kProbeKindCount
+};
+
+const char* const probe_kind_names[kProbeKindCount] = { "none", "mmap", "proc", "open", "futex" };
+
+class LatencyProbe
+{
+public:
+	explicit LatencyProbe(ProbeKind kind)
+		: kind_(kind)
+	{
+	}
+	~LatencyProbe()
+	{
+		Stop();
+	}
+	LatencyProbe(const LatencyProbe&) = delete;
+	LatencyProbe& operator=(const LatencyProbe&) = delete;
+
+	// Clears the results and starts probing.
+	void Start()
+	{
+		Stop();
+		times_.Clear();
+		timeline_.clear();
+		if (kind_ == kProbeNone)
+			return;
+		stop_ = false;
+		helper_stop_ = false;
+		request_ = 0;
+		response_ = 0;
+		start_ns_ = GetTimeNs();
+		if (kind_ == kProbeFutex)
+			helper_ = std::thread(&LatencyProbe::FutexHelper, this);
+		thread_ = std::thread(&LatencyProbe::Run, this);
+	}
+
+	void Stop()
+	{
+		stop_ = true;
+		if (thread_.joinable())
+			thread_.join();
+		if (helper_.joinable())
+		{
+			// The probe thread has finished its last round trip, so the helper
+			// can go.
+			helper_stop_ = true;
+			++request_;
+			FutexWake(&request_);
+			helper_.join();
+		}
+	}
+
+	// Prints the latency distribution and a timeline of at most max_rows rows,
+	// each showing the number of operations and the worst latency in that
+	// part of the phase.
+	void Print(const char* phase, size_t max_rows = 25) const
+	{
+		if (kind_ == kProbeNone)
+			return;
+		printf("%s probe latency during %s:\n", probe_kind_names[kind_], phase);
+		times_.PrintSummary(probe_kind_names[kind_]);
+		times_.PrintDistribution();
+		if (timeline_.empty())
+			return;
+		const size_t slots_per_row = (timeline_.size() + max_rows - 1) / max_rows;
+		printf("  Timeline (%zu ms per row):\n", slots_per_row * kSlotNs / 1000000);
+		for (size_t first = 0; first < timeline_.size(); first += slots_per_row)
+		{
+			timeline_slot row;
+			for (size_t i = first; i < std::min(first + slots_per_row, timeline_.size()); ++i)
+			{
+				row.count += timeline_[i].count;
+				row.max = std::max(row.max, timeline_[i].max);
+			}
+			char max[16];
+			LatencyHistogram::FormatNs(row.max, max, sizeof(max));
+			printf("  +%6llu ms %9llu ops, max %9s\n", (unsigned long long)(first * kSlotNs / 1000000),
+				(unsigned long long)row.count, max);
+		}
+	}
+
+	const LatencyHistogram& times() const { return times_; }
+
+private:
+	static constexpr uint64_t kSlotNs = 10 * 1000 * 1000;
+
+	struct timeline_slot
+	{
+		uint64_t count = 0;
+		uint64_t max = 0;
+	};
+
+	static uint64_t GetTimeNs()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	}
+
+	static void FutexWait(std::atomic<uint32_t>* address, uint32_t value)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(address), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+	}
+
+	static void FutexWake(std::atomic<uint32_t>* address)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(address), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+	}
+
+	void Operation()
+	{
+		switch (kind_)
+		{
+		case kProbeMmap:
+		{
+			void* p = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p != MAP_FAILED)
+			{
+				*static_cast<volatile char*>(p) = 1;
+				munmap(p, 4096);
+			}
+			break;
+		}
+		case kProbeProc:
+		{
+			char buffer[1024];
+			const int fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+			if (fd >= 0)
+			{
+				(void)!read(fd, buffer, sizeof(buffer));
+				close(fd);
+			}
+			break;
+		}
+		case kProbeOpen:
+		{
+			const int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+			if (fd >= 0)
+				close(fd);
+			break;
+		}
+		case kProbeFutex:
+		{
+			const uint32_t sequence = ++request_;
+			FutexWake(&request_);
+			for (uint32_t seen; (seen = response_.load()) != sequence; )
+				FutexWait(&response_, seen);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	void Run()
+	{
+		while (!stop_.load(std::memory_order_relaxed))
+		{
+			const uint64_t start = GetTimeNs();
+			Operation();
+			const uint64_t end = GetTimeNs();
+			const uint64_t elapsed = end - start;
+			times_.Record(elapsed);
+			const size_t slot = size_t((end - start_ns_) / kSlotNs);
+			if (slot >= timeline_.size())
+				timeline_.resize(slot + 1);
+			++timeline_[slot].count;
+			timeline_[slot].max = std::max(timeline_[slot].max, elapsed);
+		}
+	}
+
+	// The other half of the futex round trip. It answers each request from
+	// the probe thread by copying the sequence number to response_.
+	void FutexHelper()
+	{
+		uint32_t last = 0;
+		for (;;)
+		{
+			uint32_t seen;
+			while ((seen = request_.load()) == last)
+				FutexWait(&request_, seen);
+			if (helper_stop_)
+				return;
+			last = seen;
+			response_ = seen;
+			FutexWake(&response_);
+		}
+	}
+
+	const ProbeKind kind_;
+	std::atomic<bool> stop_{ true };
+	std::atomic<bool> helper_stop_{ true };
+	std::atomic<uint32_t> request_{ 0 };
+	std::atomic<uint32_t> response_{ 0 };
+	uint64_t start_ns_ = 0;
+	LatencyHistogram times_;
+	std::vector<timeline_slot> timeline_;
+	std::thread thread_;
+	std::thread helper_;
+};
@@ -0,0 +1,626 @@
+// Linux version of ProcessCreateTests.cpp.
+// The first process creates a tree of descendants - by default 40 children
+// with 24 grandchildren each, as on Windows - and times how long it takes
+// until they are all running, and then how long it takes them all to exit
+// once they are told to. As on Windows, startup and shutdown are synchronized
+// with a pair of named semaphores.
+// The shape of the tree and the way that each process is created can be
+// chosen, to compare fork+exec, vfork+exec, posix_spawn and clone3 for build
+// systems that launch thousands of short-lived processes. The zygote method
+// instead has a pre-initialized server process fork every descendant, and
+// each run also reports how much of the tree's memory is shared.
+// Several methods can be given, to compare them in one run.
+// While each phase runs a LatencyProbe thread in the first process times a
+// chosen system call over and over, to show which kernel locks are contended
+// by mass process creation and teardown.
+//
+// Build with:
+//   g++ -O2 -std=c++17 -pthread -o ProcessCreateTests ProcessCreateTestsLinux.cpp
+
+#include "LatencyProbe.h"
+#include "Zygote.h"
+#include "../cfg/VirtualScan/ProcMaps.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+
+extern char** environ;
+
+enum SpawnMethod
+{
+	kForkExec,
+	kVforkExec,
+	kPosixSpawn,
+	kClone3,
+	kZygote,
+	kSpawnMethodCount
+};
+
+const char* const spawn_method_names[kSpawnMethodCount] = { "fork", "vfork", "posix_spawn", "clone3", "zygote" };
+
+// The arguments to clone3. This is declared here because older kernel headers
+// don't have struct clone_args.
+struct clone3_args
+{
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t tls;
+};
+
+// What every process in the tree needs to know. Descendants are given this on
+// their command line.
+struct tree_settings
+{
+	// The first process, whose pid makes the semaphore names unique.
+	int root_pid = 0;
+	// Which repetition of the test this is. Each one gets fresh semaphores.
+	int loop = 0;
+	SpawnMethod method = kForkExec;
+	// fan_out[i] is the number of children created by each process at depth
+	// i. The first process is at depth 0.
+	std::vector<int> fan_out = { 40, 24 };
+	// Memory that each process writes as it starts up, as a stand-in for real
+	// initialization. Zygote workers inherit it from the zygote instead.
+	size_t init_mb = 0;
+};
+
+// Returns the number of descendants of a process at depth in the tree.
+int CountDescendants(const tree_settings& settings, size_t depth)
+{
+	int total = 0;
+	int level = 1;
+	for (size_t i = depth; i < settings.fan_out.size(); ++i)
+	{
+		level *= settings.fan_out[i];
+		total += level;
+	}
+	return total;
+}
+
+double GetTime()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void SemaphoreName(const tree_settings& settings, const char* purpose, char* name, size_t name_size)
+{
+	snprintf(name, name_size, "/ProcessCreate%s.%d.%d", purpose, settings.root_pid, settings.loop);
+}
+
+void WaitForSemaphore(sem_t* semaphore)
+{
+	while (sem_wait(semaphore) != 0 && errno == EINTR)
+	{
+	}
+}
+
+// Writes to every page of init_mb of memory, which is then kept until exit.
+void Initialize(size_t init_mb)
+{
+	const size_t size = init_mb * 1024 * 1024;
+	char* state = size ? new char[size] : nullptr;
+	for (size_t i = 0; i < size; i += 4096)
+		static_cast<volatile char*>(state)[i] = char(i / 4096);
+}
+
+std::string FormatFanOut(const std::vector<int>& fan_out)
+{
+	std::string text;
+	for (int count : fan_out)
+		text += (text.empty() ? "" : ",") + std::to_string(count);
+	return text;
+}
+
+// Starts exe with argv, and returns the child's pid, or -1 with errno set.
+pid_t Spawn(SpawnMethod method, const char* exe, char* const argv[])
+{
+	pid_t pid = -1;
+	switch (method)
+	{
+	case kForkExec:
+		pid = fork();
+		if (pid == 0)
+		{
+			execv(exe, argv);
+			_exit(127);
+		}
+		break;
+	case kVforkExec:
+		// The child borrows our memory and stack until it calls exec, so it
+		// must do nothing else.
+		pid = vfork();
+		if (pid == 0)
+		{
+			execv(exe, argv);
+			_exit(127);
+		}
+		break;
+	case kPosixSpawn:
+	{
+		// glibc implements this with clone(CLONE_VM | CLONE_VFORK) and a
+		// separate stack for the child.
+		const int result = posix_spawn(&pid, exe, nullptr, nullptr, argv, environ);
+		if (result != 0)
+		{
+			errno = result;
+			pid = -1;
+		}
+		break;
+	}
+	case kClone3:
+	{
+		// CLONE_VFORK suspends us until the child has called exec. CLONE_VM is
+		// left out because a child that shares our memory needs its own stack,
+		// which can't be set up around a raw system call, so the address space
+		// is copied as it is by fork.
+		clone3_args args = {};
+		args.flags = CLONE_VFORK;
+		args.exit_signal = SIGCHLD;
+		pid = pid_t(syscall(SYS_clone3, &args, sizeof(args)));
+		if (pid == 0)
+		{
+			execv(exe, argv);
+			_exit(127);
+		}
+		break;
+	}
+	default:
+		errno = EINVAL;
+		break;
+	}
+	return pid;
+}
+
+// Creates the children of a process at depth, each of which is told that it is
+// at depth + 1. If a child can't be created then its whole subtree is counted
+// as started, so that the first process doesn't wait for it forever.
+std::vector<pid_t> SpawnChildren(const tree_settings& settings, size_t depth, sem_t* sem_startup)
+{
+	std::vector<pid_t> children;
+	if (depth >= settings.fan_out.size())
+		return children;
+
+	if (settings.method == kZygote)
+	{
+		// The zygote is the parent, so there are no children to wait for.
+		int created = Zygote::Spawn(settings.root_pid, settings.fan_out[depth], settings.loop, int32_t(depth + 1));
+		if (created < 0)
+			created = 0;
+		if (created < settings.fan_out[depth])
+			printf("Zygote process creation failed.\n");
+		for (int i = created; i < settings.fan_out[depth]; ++i)
+		{
+			for (int missing = CountDescendants(settings, depth + 1) + 1; missing > 0; --missing)
+				sem_post(sem_startup);
+		}
+		return children;
+	}
+
+	char exe[PATH_MAX];
+	const ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (length <= 0)
+	{
+		printf("Can't find our own executable - errno is %d.\n", errno);
+		exit(1);
+	}
+	exe[length] = 0;
+
+	// Everything is formatted before the first spawn, since a vfork child
+	// mustn't allocate.
+	std::vector<std::string> strings =
+	{
+		exe, "-child", std::to_string(settings.root_pid), std::to_string(settings.loop),
+		spawn_method_names[settings.method], FormatFanOut(settings.fan_out), std::to_string(settings.init_mb),
+		std::to_string(depth + 1),
+	};
+	std::vector<char*> argv;
+	for (std::string& s : strings)
+		argv.push_back(&s[0]);
+	argv.push_back(nullptr);
+
+	for (int i = 0; i < settings.fan_out[depth]; ++i)
+	{
+		const pid_t pid = Spawn(settings.method, exe, argv.data());
+		if (pid > 0)
+		{
+			children.push_back(pid);
+			continue;
+		}
+		printf("Process creation failed - errno is %d.\n", errno);
+		for (int missing = CountDescendants(settings, depth + 1) + 1; missing > 0; --missing)
+			sem_post(sem_startup);
+	}
+	return children;
+}
+
+void WaitForChildren(const std::vector<pid_t>& children)
+{
+	for (pid_t pid : children)
+	{
+		while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR)
+		{
+		}
+	}
+}
+
+// Parses a fan-out list such as "40,24". Returns false if it is malformed.
+bool ParseFanOut(const char* list, std::vector<int>* fan_out)
+{
+	fan_out->clear();
+	for (const char* p = list; *p; )
+	{
+		char* end;
+		const long count = strtol(p, &end, 10);
+		if (end == p || count <= 0)
+			return false;
+		fan_out->push_back(int(count));
+		p = *end == ',' ? end + 1 : end;
+	}
+	return !fan_out->empty();
+}
+
+// A descendant: create our children, report that we are running, wait to be
+// told to exit, then wait for our children to exit.
+int RunDescendant(const tree_settings& settings, size_t depth)
+{
+	char name[64];
+	SemaphoreName(settings, "Startup", name, sizeof(name));
+	sem_t* sem_startup = sem_open(name, 0);
+	SemaphoreName(settings, "Shutdown", name, sizeof(name));
+	sem_t* sem_shutdown = sem_open(name, 0);
+	if (sem_startup == SEM_FAILED || sem_shutdown == SEM_FAILED)
+	{
+		printf("Semaphore has not been created. Exiting.\n");
+		return 0;
+	}
+
+	const std::vector<pid_t> children = SpawnChildren(settings, depth, sem_startup);
+	// Let the initial process know that we are done.
+	sem_post(sem_startup);
+	// Wait for the death signal.
+	WaitForSemaphore(sem_shutdown);
+	// Wait for all of the grandchildren to terminate.
+	WaitForChildren(children);
+	return 0;
+}
+
+// A descendant that was started with exec:
+//   -child <root pid> <loop> <method> <fan-out> <init MiB> <depth>
+int RunChild(char* argv[])
+{
+	tree_settings settings;
+	settings.root_pid = atoi(argv[2]);
+	settings.loop = atoi(argv[3]);
+	for (int method = 0; method < kSpawnMethodCount; ++method)
+	{
+		if (strcmp(argv[4], spawn_method_names[method]) == 0)
+			settings.method = SpawnMethod(method);
+	}
+	ParseFanOut(argv[5], &settings.fan_out);
+	settings.init_mb = size_t(atoi(argv[6]));
+	Initialize(settings.init_mb);
+	return RunDescendant(settings, size_t(atoi(argv[7])));
+}
+
+// The settings for zygote workers, which the zygote inherits when it is
+// forked.
+tree_settings zygote_settings;
+
+// A descendant that was forked by the zygote. It is already initialized.
+void RunZygoteWorker(int32_t loop, int32_t depth)
+{
+	tree_settings settings = zygote_settings;
+	settings.loop = loop;
+	RunDescendant(settings, size_t(depth));
+}
+
+// Returns the parent pid from /proc/<pid>/stat, or -1.
+int ReadParentPid(int pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	char buffer[512];
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	const ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (length <= 0)
+		return -1;
+	buffer[length] = 0;
+	// The command name is in parentheses and may contain anything, so parse
+	// from the last ')': ") S ppid ...".
+	const char* p = strrchr(buffer, ')');
+	int parent = -1;
+	if (!p || sscanf(p + 1, " %*c %d", &parent) != 1)
+		return -1;
+	return parent;
+}
+
+// Returns the pids of all of the descendants of root_pid.
+std::vector<int> FindDescendants(int root_pid)
+{
+	std::vector<std::pair<int, int>> parents; // (parent, pid)
+	DIR* dir = opendir("/proc");
+	if (!dir)
+		return {};
+	while (dirent* entry = readdir(dir))
+	{
+		const int pid = atoi(entry->d_name);
+		if (pid > 0)
+		{
+			const int parent = ReadParentPid(pid);
+			if (parent > 0)
+				parents.emplace_back(parent, pid);
+		}
+	}
+	closedir(dir);
+	std::sort(parents.begin(), parents.end());
+	std::vector<int> descendants;
+	std::vector<int> pending = { root_pid };
+	while (!pending.empty())
+	{
+		const int parent = pending.back();
+		pending.pop_back();
+		auto it = std::lower_bound(parents.begin(), parents.end(), std::make_pair(parent, 0));
+		for (; it != parents.end() && it->first == parent; ++it)
+		{
+			descendants.push_back(it->second);
+			pending.push_back(it->second);
+		}
+	}
+	return descendants;
+}
+
+// Memory totals for the whole tree, in bytes.
+struct tree_memory
+{
+	size_t processes = 0;
+	uint64_t rss = 0;
+	uint64_t pss = 0;
+	uint64_t private_bytes = 0;
+
+	// Pages that are mapped by more than one process - copy-on-write pages
+	// from the zygote, and shared libraries.
+	uint64_t shared() const { return rss - private_bytes; }
+};
+
+tree_memory MeasureDescendantMemory(int root_pid)
+{
+	tree_memory totals;
+	std::unique_ptr<char[]> buffer(new char[64 * 1024]);
+	for (int pid : FindDescendants(root_pid))
+	{
+		SmapsRollup rollup;
+		if (!ReadSmapsRollup(pid, buffer.get(), 64 * 1024, &rollup))
+			continue;
+		++totals.processes;
+		totals.rss += rollup.rss;
+		totals.pss += rollup.pss;
+		totals.private_bytes += rollup.private_clean + rollup.private_dirty;
+	}
+	return totals;
+}
+
+void PrintMemory(const tree_memory& memory)
+{
+	const double mb = 1024.0 * 1024.0;
+	printf("Memory of %zu processes: Rss %.1f MiB, Pss %.1f MiB, private %.1f MiB, shared %.1f MiB (%.0f%% of Rss).\n",
+		memory.processes, memory.rss / mb, memory.pss / mb, memory.private_bytes / mb, memory.shared() / mb,
+		memory.rss ? 100.0 * memory.shared() / memory.rss : 0.0);
+}
+
+// Results from one method, for the summary at the end.
+struct method_results
+{
+	SpawnMethod method;
+	double creation_s = 0;
+	double destruction_s = 0;
+	tree_memory memory;
+};
+
+int main(int argc, char* argv[])
+{
+	if (argc == 8 && strcmp(argv[1], "-child") == 0)
+		return RunChild(argv);
+
+	tree_settings settings;
+	std::vector<SpawnMethod> methods;
+	int num_loops = 1;
+	bool usage = false;
+	int depth = 0;
+	ProbeKind probe_kind = kProbeMmap;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-method") == 0 && i + 1 < argc)
+		{
+			// A comma-separated list of methods to compare.
+			for (char* name = strtok(argv[++i], ","); name; name = strtok(nullptr, ","))
+			{
+				int method = 0;
+				while (method < kSpawnMethodCount && strcmp(name, spawn_method_names[method]) != 0)
+					++method;
+				usage |= method == kSpawnMethodCount;
+				methods.push_back(SpawnMethod(method));
+			}
+		}
+		else if (strcmp(argv[i], "-probe") == 0 && i + 1 < argc)
+		{
+			++i;
+			int kind = 0;
+			while (kind < kProbeKindCount && strcmp(argv[i], probe_kind_names[kind]) != 0)
+				++kind;
+			usage |= kind == kProbeKindCount;
+			probe_kind = ProbeKind(kind);
+		}
+		else if (strcmp(argv[i], "-fanout") == 0 && i + 1 < argc)
+			usage |= !ParseFanOut(argv[++i], &settings.fan_out);
+		else if (strcmp(argv[i], "-depth") == 0 && i + 1 < argc)
+			depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-init") == 0 && i + 1 < argc)
+			settings.init_mb = size_t(atoi(argv[++i]));
+		else if (strcmp(argv[i], "-loops") == 0 && i + 1 < argc)
+			num_loops = atoi(argv[++i]);
+		else
+			usage = true;
+	}
+	// -depth repeats the last fan-out, so "-fanout 4 -depth 5" is a tree of
+	// 4 + 16 + ... + 1024 descendants.
+	if (depth > 0)
+		settings.fan_out.resize(size_t(depth), settings.fan_out.back());
+	if (methods.empty())
+		methods.push_back(kForkExec);
+	if (usage)
+	{
+		printf("Usage: ProcessCreateTests [-method fork|vfork|posix_spawn|clone3|zygote,...] [-fanout n,n,...]\n");
+		printf("                          [-depth n] [-init MiB] [-probe mmap|proc|open|futex|none] [-loops n]\n");
+		printf("  -method can list several methods to compare them (default fork).\n");
+		printf("  -fanout is the number of children per process at each depth (default 40,24).\n");
+		printf("  -depth extends or truncates the fan-out list, repeating its last entry.\n");
+		printf("  -init is memory that each process initializes at startup (default 0).\n");
+		printf("         Zygote workers inherit it from the zygote instead.\n");
+		printf("  -probe times mmap+munmap, a /proc read, open+close or a futex round trip\n");
+		printf("         in a tight loop during each phase (default mmap).\n");
+		return 1;
+	}
+
+	settings.root_pid = getpid();
+	const int num_descendants = CountDescendants(settings, 0);
+	// Print the main process PID for ease of profiling.
+	printf("Main process pid is %d.\n", getpid());
+
+	// The zygote is started, and initialized, before any timing starts - that
+	// is the cost that it amortizes.
+	Zygote zygote;
+	if (std::find(methods.begin(), methods.end(), kZygote) != methods.end())
+	{
+		zygote_settings = settings;
+		zygote_settings.method = kZygote;
+		if (!zygote.Start(settings.root_pid, settings.init_mb * 1024 * 1024, RunZygoteWorker))
+		{
+			printf("Failed to start the zygote - errno is %d. Exiting.\n", errno);
+			return 1;
+		}
+	}
+
+	LatencyProbe probe(probe_kind);
+	std::vector<method_results> all_results;
+	int run = 0;
+	for (SpawnMethod method : methods)
+	{
+		settings.method = method;
+		for (int i = 0; i < num_loops; ++i)
+		{
+			settings.loop = run++;
+			char startup_name[64];
+			char shutdown_name[64];
+			SemaphoreName(settings, "Startup", startup_name, sizeof(startup_name));
+			SemaphoreName(settings, "Shutdown", shutdown_name, sizeof(shutdown_name));
+			// Child processes signal this when they have finished starting up.
+			sem_t* sem_startup = sem_open(startup_name, O_CREAT | O_EXCL, 0600, 0);
+			// The initial process signals this when the child processes should
+			// shut down.
+			sem_t* sem_shutdown = sem_open(shutdown_name, O_CREAT | O_EXCL, 0600, 0);
+			if (sem_startup == SEM_FAILED || sem_shutdown == SEM_FAILED)
+			{
+				printf("Failed to create the semaphores - errno is %d. Exiting.\n", errno);
+				return 1;
+			}
+
+			method_results results;
+			results.method = method;
+			printf("Testing with %d descendant processes (fan-out %s) created with %s.\n", num_descendants,
+				FormatFanOut(settings.fan_out).c_str(), spawn_method_names[method]);
+			fflush(stdout);
+			// Start up a probe thread to look for lock contention.
+			probe.Start();
+			const double start = GetTime();
+			const std::vector<pid_t> children = SpawnChildren(settings, 0, sem_startup);
+			// Wait for all spawned processes to say that they are running.
+			for (int j = 0; j < num_descendants; ++j)
+				WaitForSemaphore(sem_startup);
+			results.creation_s = GetTime() - start;
+			probe.Stop();
+			printf("Process creation took %1.3f s (%1.3f ms per process).\n", results.creation_s,
+				(results.creation_s * 1000) / num_descendants);
+			probe.Print("creation");
+			// Every descendant has opened the semaphores by now, so their names
+			// can go.
+			sem_unlink(startup_name);
+			sem_unlink(shutdown_name);
+			// This includes the zygote, if there is one, since the memory that it
+			// shares with its workers has to be paid for somewhere.
+			results.memory = MeasureDescendantMemory(settings.root_pid);
+			PrintMemory(results.memory);
+
+			// Pause briefly so that there will be a visible gap in CPU usage.
+			usleep(500 * 1000);
+
+			printf("\nProcess termination starts now.\n");
+			fflush(stdout);
+			probe.Start();
+			const double death_start = GetTime();
+			// Tell all of the children to terminate.
+			for (int j = 0; j < num_descendants; ++j)
+				sem_post(sem_shutdown);
+			// Wait for all of the children to terminate.
+			if (method == kZygote)
+				Zygote::WaitForWorkers(settings.root_pid);
+			else
+				WaitForChildren(children);
+			results.destruction_s = GetTime() - death_start;
+			probe.Stop();
+			printf("Process destruction took %1.3f s (%1.3f ms per process).\n", results.destruction_s,
+				(results.destruction_s * 1000) / num_descendants);
+			probe.Print("destruction");
+			printf("\n");
+			sem_close(sem_startup);
+			sem_close(sem_shutdown);
+			all_results.push_back(results);
+		}
+	}
+	zygote.Stop();
+
+	if (all_results.size() > 1)
+	{
+		const double mb = 1024.0 * 1024.0;
+		printf("%-12s %14s %14s %10s %10s %10s\n", "Method", "create ms/proc", "destroy ms/proc", "Rss MiB",
+			"Pss MiB", "shared");
+		for (const method_results& results : all_results)
+		{
+			printf("%-12s %14.3f %15.3f %10.1f %10.1f %9.0f%%\n", spawn_method_names[results.method],
+				results.creation_s * 1000 / num_descendants, results.destruction_s * 1000 / num_descendants,
+				results.memory.rss / mb, results.memory.pss / mb,
+				results.memory.rss ? 100.0 * results.memory.shared() / results.memory.rss : 0.0);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,208 @@
+// A zygote, or prefork server, as used by Android and Chrome to make process
+// startup cheap. The zygote is forked once, does the expensive initialization
+// once, and then creates each new process by forking itself on request, so
+// that workers skip exec, the dynamic loader and initialization entirely and
+// share the zygote's initialized pages copy-on-write.
+// Requests arrive over a Unix socket in the abstract namespace, so any process
+// - including a worker - can ask for more workers. The zygote handles one
+// request at a time, reaps its workers, and can be asked to wait until they
+// have all exited, since it, not the requester, is their parent.
+
+#pragma once
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <stddef.h>
+
+class Zygote
+{
+public:
+	// Runs in each worker, with the arguments that were passed to Spawn. The
+	// worker exits when it returns.
+	using WorkerMain = void (*)(int32_t arg0, int32_t arg1);
+
+	~Zygote()
+	{
+		Stop();
+	}
+
+	// Forks the zygote, which initializes init_bytes of memory and then waits
+	// for requests. id makes the socket name unique - the caller's pid is a
+	// good choice. Returns false, with errno set, on failure.
+	bool Start(int id, size_t init_bytes, WorkerMain worker)
+	{
+		id_ = id;
+		// The socket is bound before forking, so requests can be sent as soon
+		// as this returns.
+		const int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0)
+			return false;
+		sockaddr_un address;
+		const socklen_t address_length = Address(id, &address);
+		if (bind(listen_fd, reinterpret_cast<sockaddr*>(&address), address_length) != 0 ||
+			listen(listen_fd, SOMAXCONN) != 0)
+		{
+			close(listen_fd);
+			return false;
+		}
+		fflush(stdout);
+		pid_ = fork();
+		if (pid_ == 0)
+		{
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			Serve(listen_fd, init_bytes, worker);
+			_exit(0);
+		}
+		close(listen_fd);
+		return pid_ > 0;
+	}
+
+	// Shuts the zygote down once its workers have exited.
+	void Stop()
+	{
+		if (pid_ <= 0)
+			return;
+		Call(id_, { kQuit, 0, 0, 0 });
+		waitpid(pid_, nullptr, 0);
+		pid_ = 0;
+	}
+
+	pid_t pid() const { return pid_; }
+
+	// Asks the zygote with this id for count workers, and returns how many it
+	// created, or -1 if it couldn't be reached.
+	static int Spawn(int id, int32_t count, int32_t arg0, int32_t arg1)
+	{
+		return Call(id, { kSpawn, count, arg0, arg1 });
+	}
+
+	// Waits until all of the workers have exited.
+	static bool WaitForWorkers(int id)
+	{
+		return Call(id, { kWaitForWorkers, 0, 0, 0 }) >= 0;
+	}
+
+private:
+	enum Op : int32_t
+	{
+		kSpawn,
+		kWaitForWorkers,
+		kQuit,
+	};
+
+	struct request
+	{
+		int32_t op;
+		int32_t count;
+		int32_t arg0;
+		int32_t arg1;
+	};
+
+	static socklen_t Address(int id, sockaddr_un* address)
+	{
+		memset(address, 0, sizeof(*address));
+		address->sun_family = AF_UNIX;
+		// A leading zero byte puts the name in the abstract namespace, so
+		// there is no file to clean up.
+		const int length = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "ProcessCreateZygote.%d", id);
+		return socklen_t(offsetof(sockaddr_un, sun_path) + 1 + length);
+	}
+
+	static int Call(int id, const request& message)
+	{
+		const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		sockaddr_un address;
+		const socklen_t address_length = Address(id, &address);
+		int32_t reply = -1;
+		if (connect(fd, reinterpret_cast<sockaddr*>(&address), address_length) == 0 &&
+			send(fd, &message, sizeof(message), MSG_NOSIGNAL) == ssize_t(sizeof(message)))
+		{
+			if (recv(fd, &reply, sizeof(reply), 0) != ssize_t(sizeof(reply)))
+				reply = -1;
+		}
+		close(fd);
+		return reply;
+	}
+
+	static void Serve(int listen_fd, size_t init_bytes, WorkerMain worker)
+	{
+		// Stand-in for the initialization that every worker would otherwise
+		// repeat: memory that is written once, then shared with the workers.
+		char* state = init_bytes ? new char[init_bytes] : nullptr;
+		for (size_t i = 0; i < init_bytes; i += 4096)
+			static_cast<volatile char*>(state)[i] = char(i / 4096);
+
+		int live_workers = 0;
+		for (;;)
+		{
+			const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return;
+			}
+			request message;
+			if (recv(fd, &message, sizeof(message), 0) != ssize_t(sizeof(message)))
+			{
+				close(fd);
+				continue;
+			}
+			int32_t reply = 0;
+			if (message.op == kSpawn)
+			{
+				fflush(stdout);
+				for (int32_t i = 0; i < message.count; ++i)
+				{
+					const pid_t pid = fork();
+					if (pid == 0)
+					{
+						close(fd);
+						close(listen_fd);
+						worker(message.arg0, message.arg1);
+						_exit(0);
+					}
+					if (pid > 0)
+					{
+						++live_workers;
+						++reply;
+					}
+				}
+			}
+			else
+			{
+				// Both waiting and quitting wait for the workers.
+				while (live_workers > 0)
+				{
+					if (waitpid(-1, nullptr, 0) > 0)
+						--live_workers;
+					else if (errno != EINTR)
+						break;
+				}
+			}
+			// Reap any workers that have already exited, so that they don't
+			// linger as zombies.
+			while (live_workers > 0 && waitpid(-1, nullptr, WNOHANG) > 0)
+				--live_workers;
+			send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+			close(fd);
+			if (message.op == kQuit)
+				break;
+		}
+		delete[] state;
+	}
+
+	int id_ = 0;
+	pid_t pid_ = 0;
+};
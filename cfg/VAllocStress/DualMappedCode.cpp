@@ -0,0 +1,51 @@
+﻿#include "DualMappedCode.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+DualMappedCode::DualMappedCode(size_t size)
+{
+	const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+	size_ = (size + page_size - 1) & ~(page_size - 1);
+	// Called through syscall() because memfd_create was only added to glibc in
+	// 2.27.
+	fd_ = int(syscall(SYS_memfd_create, "jit-code", MFD_CLOEXEC));
+	if (fd_ < 0)
+		return;
+	if (ftruncate(fd_, off_t(size_)) != 0)
+		return;
+	void* writable = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (writable == MAP_FAILED)
+		return;
+	writable_ = static_cast<char*>(writable);
+	void* executable = mmap(nullptr, size_, PROT_READ | PROT_EXEC, MAP_SHARED, fd_, 0);
+	if (executable == MAP_FAILED)
+		return;
+	executable_ = static_cast<char*>(executable);
+}
+
+DualMappedCode::~DualMappedCode()
+{
+	if (executable_)
+		munmap(executable_, size_);
+	if (writable_)
+		munmap(writable_, size_);
+	if (fd_ >= 0)
+		close(fd_);
+}
+
+void DualMappedCode::FlushInstructionCache(const void* p, size_t size) const
+{
+#if !defined(__x86_64__) && !defined(__i386__)
+	const char* start = static_cast<const char*>(ToExecutable(p));
+	__builtin___clear_cache(const_cast<char*>(start), const_cast<char*>(start) + size);
+#else
+	(void)p;
+	(void)size;
+#endif
+}
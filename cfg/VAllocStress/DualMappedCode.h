@@ -0,0 +1,46 @@
+﻿// A W^X code buffer that never changes page protections.
+// The buffer is a memfd mapped twice - once read/write, for the JIT to write
+// and patch code through, and once read/execute, for running it. No page is
+// ever writable and executable at the same address, but patching code doesn't
+// need an mprotect call, so it doesn't take mmap_lock, split regions or cause
+// TLB shootdowns the way flipping protections does.
+// The two views are at unrelated addresses, so anything written must use
+// ToExecutable() to find where it will run, and code must not contain absolute
+// addresses of itself that were computed from the writable view.
+
+#pragma once
+
+#include <stddef.h>
+
+class DualMappedCode
+{
+public:
+	// Creates and maps a buffer of size bytes, rounded up to a whole page.
+	explicit DualMappedCode(size_t size);
+	~DualMappedCode();
+	DualMappedCode(const DualMappedCode&) = delete;
+	DualMappedCode& operator=(const DualMappedCode&) = delete;
+
+	// False if the memfd couldn't be created or mapped.
+	bool valid() const { return executable_ != nullptr; }
+
+	size_t size() const { return size_; }
+	char* writable() const { return writable_; }
+	const char* executable() const { return executable_; }
+
+	// Returns the address at which code written to p will run.
+	const void* ToExecutable(const void* p) const
+	{
+		return executable_ + (static_cast<const char*>(p) - writable_);
+	}
+
+	// Makes code written to [p, p + size) visible to instruction fetch. This is
+	// free on x86 but needed on most other architectures.
+	void FlushInstructionCache(const void* p, size_t size) const;
+
+private:
+	size_t size_ = 0;
+	int fd_ = -1;
+	char* writable_ = nullptr;
+	char* executable_ = nullptr;
+};
@@ -0,0 +1,156 @@
+﻿#include "ExecArena.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+ExecArena::ExecArena(size_t reserve_size)
+	: reserve_size_(reserve_size), page_size_(size_t(sysconf(_SC_PAGESIZE)))
+{
+	// Offsets are stored in 32 bits.
+	if (reserve_size_ > UINT32_MAX)
+		reserve_size_ = size_t(UINT32_MAX) + 1 - kMaxBlockSize;
+	// A PROT_NONE reservation costs nothing but address space and one region.
+	void* p = mmap(nullptr, reserve_size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return;
+	base_ = static_cast<char*>(p);
+	writable_.resize(reserve_size_ / page_size_);
+}
+
+ExecArena::~ExecArena()
+{
+	if (base_)
+		munmap(base_, reserve_size_);
+}
+
+int ExecArena::SizeClass(size_t size)
+{
+	int size_class = 0;
+	for (size_t class_size = kMinBlockSize; class_size < size; class_size *= 2)
+		++size_class;
+	return size_class;
+}
+
+void* ExecArena::Allocate(size_t size)
+{
+	if (!base_ || size > kMaxBlockSize)
+		return nullptr;
+	const int size_class = SizeClass(size);
+	const size_t class_size = kMinBlockSize << size_class;
+
+	size_t offset;
+	if (!free_lists_[size_class].empty())
+	{
+		// Reuse a freed block in place.
+		offset = free_lists_[size_class].back();
+		free_lists_[size_class].pop_back();
+	}
+	else
+	{
+		// Carve a new block from the frontier, aligned to its size so that small
+		// blocks never straddle a page boundary. The alignment padding is
+		// given to the smaller free lists rather than wasted.
+		size_t aligned = (frontier_ + class_size - 1) & ~(class_size - 1);
+		if (aligned + class_size > reserve_size_)
+			return nullptr;
+		for (size_t pad = frontier_; pad < aligned; )
+		{
+			size_t pad_size = kMinBlockSize;
+			while ((pad & (pad_size * 2 - 1)) == 0 && pad + pad_size * 2 <= aligned)
+				pad_size *= 2;
+			free_lists_[SizeClass(pad_size)].push_back(uint32_t(pad));
+			pad += pad_size;
+		}
+		offset = aligned;
+		frontier_ = aligned + class_size;
+		// Open up the reservation a chunk at a time, directly as writable.
+		if (frontier_ > accessible_)
+		{
+			size_t new_accessible = (frontier_ + kChunkSize - 1) & ~(kChunkSize - 1);
+			if (new_accessible > reserve_size_)
+				new_accessible = reserve_size_;
+			++protection_changes_;
+			if (mprotect(base_ + accessible_, new_accessible - accessible_, PROT_READ | PROT_WRITE) != 0)
+				return nullptr;
+			for (size_t page = accessible_ / page_size_; page < new_accessible / page_size_; ++page)
+				writable_[page] = true;
+			if (first_writable_ > accessible_ / page_size_)
+				first_writable_ = accessible_ / page_size_;
+			last_writable_ = new_accessible / page_size_;
+			accessible_ = new_accessible;
+		}
+	}
+
+	if (!MakeWritable(offset, class_size))
+	{
+		free_lists_[size_class].push_back(uint32_t(offset));
+		return nullptr;
+	}
+	allocated_bytes_ += class_size;
+	return base_ + offset;
+}
+
+void ExecArena::Free(void* p, size_t size)
+{
+	if (!p)
+		return;
+	const int size_class = SizeClass(size);
+	free_lists_[size_class].push_back(uint32_t(static_cast<char*>(p) - base_));
+	allocated_bytes_ -= kMinBlockSize << size_class;
+}
+
+bool ExecArena::MakeWritable(size_t offset, size_t size)
+{
+	const size_t first_page = offset / page_size_;
+	const size_t end_page = (offset + size + page_size_ - 1) / page_size_;
+	// Find the first page that needs changing - usually there is none, because
+	// the page is still writable from an earlier allocation in this batch.
+	size_t page = first_page;
+	while (page < end_page && writable_[page])
+		++page;
+	if (page == end_page)
+		return true;
+	++protection_changes_;
+	if (mprotect(base_ + page * page_size_, (end_page - page) * page_size_, PROT_READ | PROT_WRITE) != 0)
+		return false;
+	for (; page < end_page; ++page)
+		writable_[page] = true;
+	if (first_writable_ > first_page)
+		first_writable_ = first_page;
+	if (last_writable_ < end_page)
+		last_writable_ = end_page;
+	return true;
+}
+
+void ExecArena::Seal()
+{
+	// Flip each run of writable pages to executable with one call. Untouched
+	// pages past the frontier stay writable so that the next allocation from
+	// the frontier doesn't need a call of its own.
+	const size_t frontier_page = (frontier_ + page_size_ - 1) / page_size_;
+	const size_t end = last_writable_ < frontier_page ? last_writable_ : frontier_page;
+	size_t page = first_writable_;
+	while (page < end)
+	{
+		if (!writable_[page])
+		{
+			++page;
+			continue;
+		}
+		size_t run_end = page;
+		while (run_end < end && writable_[run_end])
+			writable_[run_end++] = false;
+		++protection_changes_;
+		mprotect(base_ + page * page_size_, (run_end - page) * page_size_, PROT_READ | PROT_EXEC);
+		page = run_end;
+	}
+	// Everything from the frontier up to the end of the accessible range is
+	// still writable.
+	first_writable_ = frontier_page;
+	last_writable_ = accessible_ / page_size_;
+	if (first_writable_ >= last_writable_)
+	{
+		first_writable_ = SIZE_MAX;
+		last_writable_ = 0;
+	}
+}
@@ -0,0 +1,85 @@
+﻿// An arena for JIT code that avoids the costs that VAllocStress measures.
+// Mapping and unmapping executable memory at new addresses churns the process's
+// region (VMA) list, takes mmap_lock in write mode every time, and every munmap
+// or protection change needs a TLB shootdown on every CPU that runs the
+// process. On Windows it also leaks CFG bitmap pages.
+// This arena reserves one large region up front and sub-allocates code blocks
+// from it in power-of-two size classes, from 64 bytes to 1 MiB. Freed blocks go
+// on a per-class free list and are reused in place, so the address space never
+// grows past the high-water mark. New blocks are writable until Seal() is
+// called, which makes everything written since the last Seal() executable with
+// one mprotect per contiguous run of pages, instead of one per block.
+//
+// Blocks that share a page with a block being written are not executable
+// between Allocate() and Seal(), so the intended use is to allocate and write
+// a batch of code and then Seal() before running any of it. The arena is not
+// thread-safe.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+class ExecArena
+{
+public:
+	// Reserves reserve_size bytes of address space. Nothing is committed until
+	// blocks are allocated.
+	explicit ExecArena(size_t reserve_size = size_t(1) << 30);
+	~ExecArena();
+	ExecArena(const ExecArena&) = delete;
+	ExecArena& operator=(const ExecArena&) = delete;
+
+	// False if the reservation failed.
+	bool valid() const { return base_ != nullptr; }
+
+	// Returns a writable block of at least size bytes, aligned to its size
+	// class, or nullptr if size is too big or the arena is full.
+	void* Allocate(size_t size);
+	// Returns a block to its free list. size must be the size that was passed
+	// to Allocate.
+	void Free(void* p, size_t size);
+	// Makes all blocks written since the last Seal() executable, and no longer
+	// writable.
+	void Seal();
+
+	static constexpr size_t kMinBlockSize = 64;
+	static constexpr size_t kMaxBlockSize = size_t(1) << 20;
+
+	size_t reserved_bytes() const { return reserve_size_; }
+	// Bytes of the reservation that have been handed out at least once.
+	size_t committed_bytes() const { return frontier_; }
+	size_t allocated_bytes() const { return allocated_bytes_; }
+	// How many mprotect calls the arena has made.
+	size_t protection_changes() const { return protection_changes_; }
+
+private:
+	static constexpr int kClassCount = 15; // 64 B to 1 MiB.
+	// The reservation is made accessible this much at a time.
+	static constexpr size_t kChunkSize = size_t(2) << 20;
+
+	static int SizeClass(size_t size);
+	// Makes the pages of [offset, offset + size) writable, if they aren't
+	// already, and remembers them for the next Seal().
+	bool MakeWritable(size_t offset, size_t size);
+
+	char* base_ = nullptr;
+	size_t reserve_size_;
+	size_t page_size_;
+	// Offset of the first byte that has never been handed out.
+	size_t frontier_ = 0;
+	// Offset up to which the reservation is no longer PROT_NONE.
+	size_t accessible_ = 0;
+	size_t allocated_bytes_ = 0;
+	size_t protection_changes_ = 0;
+	// Free blocks in each size class, as offsets from base_.
+	std::vector<uint32_t> free_lists_[kClassCount];
+	// One flag per page - true if the page is currently writable rather than
+	// executable.
+	std::vector<bool> writable_;
+	// Lowest and highest+1 writable pages, to limit Seal()'s search.
+	size_t first_writable_ = SIZE_MAX;
+	size_t last_writable_ = 0;
+};
@@ -0,0 +1,161 @@
+﻿// Log-linear latency histogram, for recording the full distribution of how
+// long an operation takes rather than just counting the outliers.
+// Each power-of-two range of nanoseconds is split into 16 linear sub-buckets,
+// so any value is recorded to within 1/16th (6.25%) of its true value, from
+// 1 ns to hundreds of years, in under 8 KiB. Recording is a few instructions
+// with no allocation, and histograms from different threads can be merged.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+class LatencyHistogram
+{
+public:
+	void Record(uint64_t ns)
+	{
+		++counts_[BucketIndex(ns)];
+		++count_;
+		total_ += ns;
+		min_ = std::min(min_, ns);
+		max_ = std::max(max_, ns);
+	}
+
+	void Merge(const LatencyHistogram& other)
+	{
+		for (int i = 0; i < kBucketCount; ++i)
+			counts_[i] += other.counts_[i];
+		count_ += other.count_;
+		total_ += other.total_;
+		min_ = std::min(min_, other.min_);
+		max_ = std::max(max_, other.max_);
+	}
+
+	void Clear()
+	{
+		*this = LatencyHistogram();
+	}
+
+	uint64_t count() const { return count_; }
+	uint64_t min() const { return count_ ? min_ : 0; }
+	uint64_t max() const { return max_; }
+	double mean() const { return count_ ? double(total_) / count_ : 0.0; }
+
+	// Returns the value below which fraction (0.0 to 1.0) of the recorded
+	// values fall, rounded up to the top of its bucket but never more than the
+	// largest value recorded.
+	uint64_t Percentile(double fraction) const
+	{
+		if (count_ == 0)
+			return 0;
+		uint64_t target = uint64_t(fraction * count_ + 0.5);
+		if (target < 1)
+			target = 1;
+		uint64_t seen = 0;
+		for (int i = 0; i < kBucketCount; ++i)
+		{
+			seen += counts_[i];
+			if (seen >= target)
+				return std::min(BucketUpperBound(i), max_);
+		}
+		return max_;
+	}
+
+	// Prints one line with the count and the interesting percentiles.
+	void PrintSummary(const char* label) const
+	{
+		char p50[16], p90[16], p99[16], p999[16], max[16];
+		FormatNs(Percentile(0.5), p50, sizeof(p50));
+		FormatNs(Percentile(0.9), p90, sizeof(p90));
+		FormatNs(Percentile(0.99), p99, sizeof(p99));
+		FormatNs(Percentile(0.999), p999, sizeof(p999));
+		FormatNs(max_, max, sizeof(max));
+		printf("%-12s %9llu ops, p50 %9s, p90 %9s, p99 %9s, p99.9 %9s, max %9s\n", label,
+			(unsigned long long)count_, p50, p90, p99, p999, max);
+	}
+
+	// Prints the whole distribution, one line per power of two, with a bar
+	// showing the share of the operations in each range.
+	void PrintDistribution() const
+	{
+		uint64_t row_counts[64] = {};
+		int first_row = 64;
+		int last_row = -1;
+		for (int i = 0; i < kBucketCount; ++i)
+		{
+			if (!counts_[i])
+				continue;
+			const int row = Log2(BucketLowerBound(i));
+			row_counts[row] += counts_[i];
+			first_row = std::min(first_row, row);
+			last_row = std::max(last_row, row);
+		}
+		for (int row = first_row; row <= last_row; ++row)
+		{
+			char low[16];
+			FormatNs(1ull << row, low, sizeof(low));
+			char bar[51] = {};
+			memset(bar, '#', size_t(50.0 * row_counts[row] / count_ + 0.5));
+			printf("  >= %9s %9llu %s\n", low, (unsigned long long)row_counts[row], bar);
+		}
+	}
+
+	// Formats a duration with units that suit its size.
+	static void FormatNs(uint64_t ns, char* text, size_t text_size)
+	{
+		if (ns < 1000)
+			snprintf(text, text_size, "%llu ns", (unsigned long long)ns);
+		else if (ns < 1000 * 1000)
+			snprintf(text, text_size, "%.1f us", ns / 1e3);
+		else if (ns < 1000 * 1000 * 1000)
+			snprintf(text, text_size, "%.2f ms", ns / 1e6);
+		else
+			snprintf(text, text_size, "%.3f s", ns / 1e9);
+	}
+
+private:
+	static constexpr int kSubBucketBits = 4;
+	static constexpr int kSubBuckets = 1 << kSubBucketBits;
+	// Values below kSubBuckets get a bucket each, then there are kSubBuckets
+	// buckets for each remaining power of two.
+	static constexpr int kBucketCount = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+	static int Log2(uint64_t value)
+	{
+		return 63 - __builtin_clzll(value | 1);
+	}
+
+	static int BucketIndex(uint64_t value)
+	{
+		if (value < kSubBuckets)
+			return int(value);
+		const int shift = Log2(value) - kSubBucketBits;
+		return (shift + 1) * kSubBuckets + int((value >> shift) & (kSubBuckets - 1));
+	}
+
+	static uint64_t BucketLowerBound(int index)
+	{
+		if (index < kSubBuckets)
+			return uint64_t(index);
+		const int shift = index / kSubBuckets - 1;
+		return uint64_t(kSubBuckets + index % kSubBuckets) << shift;
+	}
+
+	static uint64_t BucketUpperBound(int index)
+	{
+		if (index < kSubBuckets)
+			return uint64_t(index);
+		const int shift = index / kSubBuckets - 1;
+		return (uint64_t(kSubBuckets + index % kSubBuckets + 1) << shift) - 1;
+	}
+
+	uint64_t counts_[kBucketCount] = {};
+	uint64_t count_ = 0;
+	uint64_t total_ = 0;
+	uint64_t min_ = UINT64_MAX;
+	uint64_t max_ = 0;
+};
@@ -0,0 +1,848 @@
+﻿// Linux version of VAllocStress.cpp.
+// On Windows a process scanning another's address space (VirtualScan,
+// WmiPrvSE.exe) held the address-space lock for so long that VirtualAlloc
+// calls in the target took up to 50 s. On Linux anything that reads
+// /proc/<pid>/maps or smaps takes the target's mmap_lock, and mmap, munmap and
+// mprotect in the target have to wait for it, so the same shape of stall is
+// possible.
+// This program lays out its address space with the same patterns as the
+// Windows version, using PROT_EXEC mappings. Linux has no CFG bitmap to leak,
+// so the blocks are left mapped, each with one page touched, to give the
+// scanner a large and fragmented address space to walk. It then sits in a
+// loop mapping and unmapping a page of executable memory while a scanner
+// thread or process reads /proc/<pid>/smaps as fast as it can, and reports
+// the full latency distribution of the mmap and munmap calls. With -scanslice
+// the scanner instead reads maps through a RegionCursor, in small reads and
+// short slices, to show how much that helps.
+// With -storm it instead runs N threads that map, re-protect and unmap memory
+// of mixed sizes and protections as fast as they can, for each of a list of
+// thread counts, and reports how the throughput scales along with the latency
+// distribution of each operation, to catch mmap_lock regressions on machines
+// with many cores.
+// With -arena it compares ExecArena, which recycles code blocks inside one
+// reservation, against mapping each block of JIT code separately.
+// With -wx it compares two ways of patching JIT code without ever having a
+// page that is writable and executable at once: flipping the page to writable
+// and back with mprotect around each patch, and writing through a second,
+// writable mapping of the same memory (DualMappedCode), on each of a list of
+// thread counts.
+//
+// Build with:
+//   g++ -O2 -std=c++17 -pthread -o VAllocStress VAllocStressLinux.cpp ExecArena.cpp DualMappedCode.cpp
+
+#include "DualMappedCode.h"
+#include "ExecArena.h"
+#include "LatencyHistogram.h"
+#include "../VirtualScan/ProcMaps.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+static_assert(sizeof(void*) == 8, "64-bit builds only.");
+
+constexpr size_t one_kb = 1024;
+constexpr size_t one_mb = one_kb * one_kb;
+constexpr size_t one_gb = one_mb * one_kb;
+constexpr size_t one_tb = one_gb * one_kb;
+
+// Size of the buffer that /proc files are read into.
+constexpr size_t kReadBufferSize = 256 * 1024;
+
+uint64_t GetTimeNs()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// State shared with the scanner, which may be in a child process, so this
+// lives in a MAP_SHARED mapping.
+struct scanner_state
+{
+	std::atomic<bool> stop;
+	LatencyHistogram scan_times;
+};
+
+// Reads /proc/<pid>/<file> from start to end, over and over, until told to
+// stop or until the target process goes away. Every read() of the file holds
+// the target's mmap_lock while the kernel formats the next chunk. If slice_us
+// is set, maps is walked with a RegionCursor instead, in slices of slice_us.
+void ScannerLoop(int pid, const char* file, unsigned slice_us, scanner_state* state)
+{
+	std::unique_ptr<char[]> buffer(new char[kReadBufferSize]);
+	if (slice_us)
+	{
+		RegionCursor cursor(pid, buffer.get(), kReadBufferSize);
+		uint64_t start = GetTimeNs();
+		while (!state->stop.load(std::memory_order_relaxed))
+		{
+			const RegionCursor::Status status = cursor.Scan(slice_us * 1000ull, 0, [](const MapsRegion&)
+			{
+				return true;
+			});
+			if (status == RegionCursor::kFailed)
+				break;
+			if (status == RegionCursor::kDone)
+			{
+				state->scan_times.Record(GetTimeNs() - start);
+				start = GetTimeNs();
+			}
+		}
+		return;
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+	while (!state->stop.load(std::memory_order_relaxed))
+	{
+		const uint64_t start = GetTimeNs();
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			break;
+		while (read(fd, buffer.get(), kReadBufferSize) > 0)
+		{
+		}
+		close(fd);
+		state->scan_times.Record(GetTimeNs() - start);
+	}
+}
+
+// Returns the number of regions (VMAs) in this process.
+size_t CountRegions(char* buffer)
+{
+	size_t count = 0;
+	ForEachMapsRegion(getpid(), buffer, kReadBufferSize, [&](const MapsRegion&)
+	{
+		++count;
+		return true;
+	});
+	return count;
+}
+
+void PrintAddressSpace(const char* when, char* buffer)
+{
+	const int64_t vm_pte = ReadStatusField(getpid(), "VmPTE", buffer, kReadBufferSize);
+	printf("%s with %zu regions and %.1f MiB of page tables.\n", when, CountRegions(buffer),
+		vm_pte >= 0 ? vm_pte / double(one_mb) : 0.0);
+}
+
+void PrintLatencies(const LatencyHistogram& mmap_times, const LatencyHistogram& munmap_times,
+	const scanner_state* scanner, double elapsed_s)
+{
+	printf("After %.0f s:\n", elapsed_s);
+	mmap_times.PrintSummary("mmap");
+	mmap_times.PrintDistribution();
+	munmap_times.PrintSummary("munmap");
+	munmap_times.PrintDistribution();
+	if (scanner)
+	{
+		// The scanner updates this concurrently so it may be slightly torn.
+		scanner->scan_times.PrintSummary("scan");
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+// Operations performed by -storm. Each gets its own latency histogram.
+enum StormOp
+{
+	kStormMmap,
+	kStormMprotect,
+	kStormMunmap,
+	kStormOpCount
+};
+
+const char* const storm_op_names[kStormOpCount] = { "mmap", "mprotect", "munmap" };
+
+// Per-thread results from -storm, padded so that threads don't share cache
+// lines.
+struct alignas(64) storm_results
+{
+	LatencyHistogram times[kStormOpCount];
+	uint64_t failures = 0;
+};
+
+// One storm thread. It keeps a small set of live mappings of mixed sizes and
+// randomly maps, re-protects or unmaps them until told to stop. Re-protecting
+// part of a mapping splits it, so the number of regions keeps changing too.
+void StormThread(unsigned seed, const std::atomic<bool>* stop, storm_results* results)
+{
+	const int protections[] =
+	{
+		PROT_READ,
+		PROT_READ | PROT_WRITE,
+		PROT_READ | PROT_EXEC,
+		PROT_READ | PROT_WRITE | PROT_EXEC,
+	};
+	constexpr int kSlots = 64;
+	struct mapping
+	{
+		char* p;
+		size_t size;
+	};
+	mapping slots[kSlots] = {};
+	std::mt19937 rng(seed);
+
+	while (!stop->load(std::memory_order_relaxed))
+	{
+		mapping& slot = slots[rng() % kSlots];
+		const int protection = protections[rng() % std::size(protections)];
+		const uint64_t start = GetTimeNs();
+		StormOp op;
+		bool succeeded;
+		if (!slot.p)
+		{
+			// Sizes from 4 KiB to 2 MiB, in powers of two.
+			op = kStormMmap;
+			slot.size = 4096 << (rng() % 10);
+			void* p = mmap(nullptr, slot.size, protection, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			succeeded = p != MAP_FAILED;
+			slot.p = succeeded ? static_cast<char*>(p) : nullptr;
+		}
+		else if (rng() % 2)
+		{
+			// Change the protection of the whole mapping or of its first half.
+			op = kStormMprotect;
+			const size_t size = slot.size > 4096 && rng() % 2 ? slot.size / 2 : slot.size;
+			succeeded = mprotect(slot.p, size, protection) == 0;
+		}
+		else
+		{
+			op = kStormMunmap;
+			succeeded = munmap(slot.p, slot.size) == 0;
+			slot.p = nullptr;
+		}
+		results->times[op].Record(GetTimeNs() - start);
+		if (!succeeded)
+			++results->failures;
+	}
+
+	for (const mapping& slot : slots)
+	{
+		if (slot.p)
+			munmap(slot.p, slot.size);
+	}
+}
+
+// Runs the storm with each of the thread counts in turn, for seconds each, and
+// prints the throughput and the latency distribution of each operation, so
+// that lock contention shows up as throughput that stops scaling and as a
+// growing tail.
+void RunStorm(const std::vector<unsigned>& thread_counts, unsigned seconds)
+{
+	printf("%8s %12s %14s %10s\n", "Threads", "ops/s", "ops/s/thread", "Scaling");
+	double single_thread_rate = 0;
+	for (unsigned thread_count : thread_counts)
+	{
+		std::atomic<bool> stop(false);
+		std::vector<storm_results> results(thread_count);
+		std::vector<std::thread> threads;
+		const uint64_t start = GetTimeNs();
+		for (unsigned i = 0; i < thread_count; ++i)
+			threads.emplace_back(StormThread, i + 1, &stop, &results[i]);
+		std::this_thread::sleep_for(std::chrono::seconds(seconds));
+		stop = true;
+		for (auto& thread : threads)
+			thread.join();
+		const double elapsed_s = (GetTimeNs() - start) / 1e9;
+
+		storm_results total;
+		for (const storm_results& result : results)
+		{
+			for (int op = 0; op < kStormOpCount; ++op)
+				total.times[op].Merge(result.times[op]);
+			total.failures += result.failures;
+		}
+		uint64_t ops = 0;
+		for (int op = 0; op < kStormOpCount; ++op)
+			ops += total.times[op].count();
+		const double rate = ops / elapsed_s;
+		// Scaling is relative to the first (normally single-threaded) run.
+		if (single_thread_rate == 0)
+			single_thread_rate = rate / thread_count;
+		printf("%8u %12.0f %14.0f %9.2fx\n", thread_count, rate, rate / thread_count,
+			rate / single_thread_rate);
+		for (int op = 0; op < kStormOpCount; ++op)
+			total.times[op].PrintSummary(storm_op_names[op]);
+		if (total.failures)
+			printf("  %llu operations failed.\n", (unsigned long long)total.failures);
+		fflush(stdout);
+	}
+}
+
+// Parses a thread-count list such as "1,2,4,8". An empty or invalid list gives
+// powers of two up to the number of CPUs.
+std::vector<unsigned> ParseThreadCounts(const char* list)
+{
+	std::vector<unsigned> counts;
+	for (const char* p = list; *p; )
+	{
+		char* end;
+		unsigned long count = strtoul(p, &end, 10);
+		if (end == p)
+			break;
+		if (count > 0)
+			counts.push_back(unsigned(count));
+		p = *end == ',' ? end + 1 : end;
+	}
+	if (counts.empty())
+	{
+		const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned count = 1; count < cpus; count *= 2)
+			counts.push_back(count);
+		counts.push_back(cpus);
+	}
+	return counts;
+}
+
+// Writes a tiny function - just a return instruction - into a code block, and
+// later calls it to check that the block really is executable.
+void WriteCode(void* p, size_t size)
+{
+	// Fill the block as a JIT would, with int3 padding after the code.
+	memset(p, 0xCC, size);
+	*static_cast<unsigned char*>(p) = 0xC3;
+}
+
+void RunCode(void* p)
+{
+#if defined(__x86_64__)
+	reinterpret_cast<void (*)()>(p)();
+#else
+	(void)p;
+#endif
+}
+
+// The -arena workload: a JIT-like mix of code blocks from 64 bytes to 16 KiB
+// being created and thrown away, with up to kLiveBlocks alive at a time. Code
+// is written in batches of kBatchSize blocks and the newest block in each
+// batch is run once the batch is sealed.
+constexpr size_t kLiveBlocks = 4096;
+constexpr size_t kBatchSize = 32;
+
+struct code_workload_results
+{
+	double seconds;
+	size_t regions;
+	int64_t rss;
+	size_t system_calls;
+};
+
+// written(p, size) is called after each block is written, and seal() after
+// each batch.
+template <typename Allocate, typename Free, typename Written, typename Seal>
+code_workload_results RunCodeWorkload(size_t ops, char* buffer, Allocate allocate, Free free, Written written,
+	Seal seal)
+{
+	struct block
+	{
+		void* p;
+		size_t size;
+	};
+	std::vector<block> live(kLiveBlocks);
+	std::mt19937 rng(1);
+	const uint64_t start = GetTimeNs();
+	void* newest = nullptr;
+	for (size_t op = 0; op < ops; ++op)
+	{
+		block& slot = live[rng() % kLiveBlocks];
+		if (slot.p)
+			free(slot.p, slot.size);
+		slot.size = (size_t(64) << (rng() % 9)) - rng() % 64;
+		slot.p = allocate(slot.size);
+		if (slot.p)
+		{
+			WriteCode(slot.p, slot.size);
+			written(slot.p, slot.size);
+			newest = slot.p;
+		}
+		if (op % kBatchSize == kBatchSize - 1)
+		{
+			seal();
+			if (newest)
+				RunCode(newest);
+			newest = nullptr;
+		}
+	}
+	seal();
+	code_workload_results results = {};
+	results.seconds = (GetTimeNs() - start) / 1e9;
+	results.regions = CountRegions(buffer);
+	results.rss = ReadStatusField(getpid(), "VmRSS", buffer, kReadBufferSize);
+	for (const block& slot : live)
+	{
+		if (slot.p)
+			free(slot.p, slot.size);
+	}
+	return results;
+}
+
+// Compares ExecArena with giving each code block its own mapping, which is
+// written and then switched to executable with mprotect.
+void RunArenaComparison(size_t ops, char* buffer)
+{
+	const int64_t base_rss = ReadStatusField(getpid(), "VmRSS", buffer, kReadBufferSize);
+	const size_t base_regions = CountRegions(buffer);
+	printf("Running %zu JIT-style allocations, %zu blocks live, sealed in batches of %zu.\n", ops, kLiveBlocks, kBatchSize);
+	printf("%-10s %10s %12s %14s %12s\n", "", "ops/s", "new regions", "RSS growth", "syscalls");
+
+	size_t mmap_calls = 0;
+	code_workload_results mmap_results = RunCodeWorkload(ops, buffer,
+		[&](size_t size) -> void*
+		{
+			++mmap_calls;
+			void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			return p == MAP_FAILED ? nullptr : p;
+		},
+		[&](void* p, size_t size)
+		{
+			++mmap_calls;
+			munmap(p, size);
+		},
+		// Separate mappings can't be sealed as a batch, so each one is made
+		// executable as soon as it is written.
+		[&](void* p, size_t size)
+		{
+			++mmap_calls;
+			mprotect(p, size, PROT_READ | PROT_EXEC);
+		},
+		[]()
+		{
+		});
+
+	ExecArena arena;
+	if (!arena.valid())
+	{
+		printf("Failed to reserve the arena. Exiting.\n");
+		return;
+	}
+	code_workload_results arena_results = RunCodeWorkload(ops, buffer,
+		[&](size_t size) { return arena.Allocate(size); },
+		[&](void* p, size_t size) { arena.Free(p, size); },
+		[](void*, size_t) {},
+		[&]() { arena.Seal(); });
+
+	const code_workload_results* results[] = { &mmap_results, &arena_results };
+	const char* const names[] = { "mmap", "ExecArena" };
+	const size_t calls[] = { mmap_calls, arena.protection_changes() };
+	for (int i = 0; i < 2; ++i)
+	{
+		printf("%-10s %10.0f %12lld %10.1f MiB %12zu\n", names[i], ops / results[i]->seconds,
+			(long long)results[i]->regions - (long long)base_regions,
+			(results[i]->rss - base_rss) / double(one_mb), calls[i]);
+	}
+	printf("ExecArena high-water mark %.1f MiB of a %.0f MiB reservation.\n",
+		arena.committed_bytes() / double(one_mb), arena.reserved_bytes() / double(one_mb));
+}
+
+// Patches made by -wx are a function that returns a random number - on x86-64,
+// mov eax, imm32 followed by ret - written into a 16-byte slot.
+constexpr size_t kPatchSize = 16;
+// Each -wx thread patches code in its own range of this many pages, so that
+// threads never run code that another thread is in the middle of changing.
+constexpr size_t kPatchPagesPerThread = 16;
+
+void WritePatch(char* p, uint32_t value)
+{
+	memset(p, 0xCC, kPatchSize);
+	p[0] = char(0xB8);
+	memcpy(p + 1, &value, sizeof(value));
+	p[5] = char(0xC3);
+}
+
+// Runs a patch through its executable address and checks that it returns the
+// value that was written.
+bool RunPatch(const char* p, uint32_t value)
+{
+#if defined(__x86_64__)
+	return reinterpret_cast<uint32_t (*)()>(const_cast<char*>(p))() == value;
+#else
+	(void)p;
+	(void)value;
+	return true;
+#endif
+}
+
+// Per-thread results from -wx, padded so that threads don't share cache lines.
+struct alignas(64) patch_results
+{
+	LatencyHistogram times;
+	uint64_t failures = 0;
+};
+
+// One -wx thread. It repeatedly patches a random slot in its range of the code
+// buffer and runs it. If dual is null the range is a single mapping, and each
+// patch flips the page to writable and back; otherwise writable and executable
+// are the two views of dual.
+void PatchThread(char* writable, const char* executable, size_t size, const DualMappedCode* dual, unsigned seed,
+	const std::atomic<bool>* stop, patch_results* results)
+{
+	const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+	std::mt19937 rng(seed);
+	while (!stop->load(std::memory_order_relaxed))
+	{
+		const size_t offset = rng() % (size / kPatchSize) * kPatchSize;
+		const uint32_t value = uint32_t(rng());
+		const uint64_t start = GetTimeNs();
+		if (dual)
+		{
+			WritePatch(writable + offset, value);
+			dual->FlushInstructionCache(writable + offset, kPatchSize);
+		}
+		else
+		{
+			char* page = writable + (offset & ~(page_size - 1));
+			if (mprotect(page, page_size, PROT_READ | PROT_WRITE) != 0)
+			{
+				++results->failures;
+				continue;
+			}
+			WritePatch(writable + offset, value);
+			mprotect(page, page_size, PROT_READ | PROT_EXEC);
+#if !defined(__x86_64__) && !defined(__i386__)
+			__builtin___clear_cache(writable + offset, writable + offset + kPatchSize);
+#endif
+		}
+		const bool correct = RunPatch(executable + offset, value);
+		results->times.Record(GetTimeNs() - start);
+		if (!correct)
+			++results->failures;
+	}
+}
+
+// Compares patching code by flipping page protections with patching it
+// through a second mapping, on each of the thread counts in turn, for seconds
+// each. The time recorded for each patch includes running it.
+void RunPatchComparison(const std::vector<unsigned>& thread_counts, unsigned seconds)
+{
+	const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+	const unsigned max_threads = *std::max_element(thread_counts.begin(), thread_counts.end());
+	const size_t range_size = kPatchPagesPerThread * page_size;
+	const size_t size = max_threads * range_size;
+
+	// All threads share one mapping, as they would share a JIT's code heap, so
+	// each mprotect splits and then re-merges the same region.
+	void* flipped = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	DualMappedCode dual(size);
+	if (flipped == MAP_FAILED || !dual.valid())
+	{
+		printf("Failed to map the code buffers - errno is %d. Exiting.\n", errno);
+		return;
+	}
+
+	const char* const method_names[] = { "mprotect", "dual-mapped" };
+	printf("Patching %zu-byte functions in %zu KiB of code per thread.\n", kPatchSize, range_size / one_kb);
+	printf("%-12s %8s %12s %16s %10s\n", "Method", "Threads", "patches/s", "patches/s/thread", "Scaling");
+	for (int method = 0; method < 2; ++method)
+	{
+		const bool use_dual = method == 1;
+		char* const writable = use_dual ? dual.writable() : static_cast<char*>(flipped);
+		const char* const executable = use_dual ? dual.executable() : static_cast<char*>(flipped);
+		double single_thread_rate = 0;
+		for (unsigned thread_count : thread_counts)
+		{
+			std::atomic<bool> stop(false);
+			std::vector<patch_results> results(thread_count);
+			std::vector<std::thread> threads;
+			const uint64_t start = GetTimeNs();
+			for (unsigned i = 0; i < thread_count; ++i)
+			{
+				threads.emplace_back(PatchThread, writable + i * range_size, executable + i * range_size, range_size,
+					use_dual ? &dual : nullptr, i + 1, &stop, &results[i]);
+			}
+			std::this_thread::sleep_for(std::chrono::seconds(seconds));
+			stop = true;
+			for (auto& thread : threads)
+				thread.join();
+			const double elapsed_s = (GetTimeNs() - start) / 1e9;
+
+			patch_results total;
+			for (const patch_results& result : results)
+			{
+				total.times.Merge(result.times);
+				total.failures += result.failures;
+			}
+			const double rate = total.times.count() / elapsed_s;
+			if (single_thread_rate == 0)
+				single_thread_rate = rate / thread_count;
+			printf("%-12s %8u %12.0f %16.0f %9.2fx\n", method_names[method], thread_count, rate,
+				rate / thread_count, rate / single_thread_rate);
+			total.times.PrintSummary("patch");
+			if (total.failures)
+				printf("  %llu patches failed.\n", (unsigned long long)total.failures);
+			fflush(stdout);
+		}
+	}
+	munmap(flipped, size);
+}
+
+int main(int argc, char* argv[])
+{
+	// Print the PID so that we can easily scan this process using VirtualScan.
+	printf("pid is %d. Scan with \"VirtualScan %d\" or \"VirtualScan -watch 1000 VAllocStress\".\n", getpid(), getpid());
+
+	const char* arg = "-fewbigblocks";
+	const char* scanner_type = "thread";
+	const char* scan_file = "smaps";
+	unsigned interval_ms = 10;
+	unsigned slice_us = 0;
+	unsigned report_s = 10;
+	unsigned run_s = 0;
+	const char* storm_threads = nullptr;
+	size_t arena_ops = 0;
+	const char* wx_threads = nullptr;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-scanner") == 0 && i + 1 < argc)
+			scanner_type = argv[++i];
+		else if (strcmp(argv[i], "-scanfile") == 0 && i + 1 < argc)
+			scan_file = argv[++i];
+		else if (strcmp(argv[i], "-scanslice") == 0 && i + 1 < argc)
+			slice_us = unsigned(atoi(argv[++i]));
+		else if (strcmp(argv[i], "-interval") == 0 && i + 1 < argc)
+			interval_ms = unsigned(atoi(argv[++i]));
+		else if (strcmp(argv[i], "-report") == 0 && i + 1 < argc)
+			report_s = unsigned(atoi(argv[++i]));
+		else if (strcmp(argv[i], "-seconds") == 0 && i + 1 < argc)
+			run_s = unsigned(atoi(argv[++i]));
+		else if (strcmp(argv[i], "-arena") == 0)
+			arena_ops = i + 1 < argc && argv[i + 1][0] != '-' ? size_t(atoll(argv[++i])) : 1000000;
+		else if (strcmp(argv[i], "-storm") == 0)
+			storm_threads = i + 1 < argc && argv[i + 1][0] != '-' ? argv[++i] : "";
+		else if (strcmp(argv[i], "-wx") == 0)
+			wx_threads = i + 1 < argc && argv[i + 1][0] != '-' ? argv[++i] : "";
+		else
+			arg = argv[i];
+	}
+	if (strcmp(scanner_type, "thread") != 0 && strcmp(scanner_type, "process") != 0 && strcmp(scanner_type, "none") != 0)
+	{
+		printf("Usage: VAllocStress [-onebigblock|-fewbigblocks|-manyblocks|-supersparse] [-scanner thread|process|none]\n");
+		printf("                    [-scanfile smaps|maps] [-scanslice us] [-interval ms] [-report s] [-seconds s]\n");
+		printf("                    [-storm [thread,counts,...]] [-arena [ops]] [-wx [thread,counts,...]]\n");
+		printf("  -storm runs mmap/mprotect/munmap on each number of threads for -seconds\n");
+		printf("         (default 2), with thread counts defaulting to 1, 2, 4, ... CPUs.\n");
+		printf("  -arena compares ExecArena with one mapping per code block (default 1000000 ops).\n");
+		printf("  -scanslice makes the scanner read maps with a RegionCursor, in slices of us.\n");
+		printf("  -wx compares patching code with mprotect flips and through a dual mapping,\n");
+		printf("      for -seconds (default 2) on each number of threads.\n");
+		return 1;
+	}
+
+	// Minimum allocation count is one.
+	size_t num_allocs = 1;
+	// Minimum allocation size is one 4-KB page of code memory.
+	size_t alloc_size = 4 * one_kb;
+	// The Windows version uses a 256 KB minimum stride to match the CFG bitmap
+	// granularity. Keep it so that the layouts are the same.
+	size_t alloc_stride = 256 * one_kb;
+
+	if (strcmp(arg, "-onebigblock") == 0)
+	{
+		const size_t target_cfg_size = 64 * 1024LL * 1024LL;
+		alloc_size = target_cfg_size * 64;
+	}
+	else if (strcmp(arg, "-fewbigblocks") == 0)
+	{
+		// 128 1-GB blocks of memory, at every other GB.
+		num_allocs = 128;
+		alloc_size = alloc_stride = one_gb;
+		alloc_stride *= 2;
+	}
+	else if (strcmp(arg, "-manyblocks") == 0)
+	{
+		num_allocs = 20000;
+		alloc_size = one_mb;
+	}
+	else if (strcmp(arg, "-supersparse") == 0)
+	{
+		// 12800 allocations with a stride of 10 GB covers almost all of the
+		// 128 TB user address space, so the loop stops a bit early. This
+		// maximizes the page-table cost.
+		num_allocs = 12800;
+		alloc_stride = 10 * one_gb;
+	}
+	else
+	{
+		num_allocs = 100;
+		alloc_size = 128 * one_mb;
+		printf("No recognized arguments, using useful defaults.\n");
+	}
+
+	// For this program it doesn't make sense to have the stride smaller than the
+	// allocation size. Unlike Windows, Linux merges adjacent mappings with the
+	// same protection into one region, so leave a page between them.
+	if (alloc_size >= alloc_stride)
+		alloc_stride = alloc_size + 4 * one_kb;
+
+	char scan_description[64];
+	if (slice_us)
+		snprintf(scan_description, sizeof(scan_description), "maps in %u us slices", slice_us);
+	else
+		snprintf(scan_description, sizeof(scan_description), "%s", scan_file);
+
+	std::unique_ptr<char[]> buffer(new char[kReadBufferSize]);
+	PrintAddressSpace("Started", buffer.get());
+
+	// MAP_FIXED_NOREPLACE makes the hint mandatory without clobbering anything
+	// that is already mapped - those addresses are just skipped.
+	constexpr auto null_char = static_cast<char*>(nullptr);
+	size_t alloc_count = 0;
+	LatencyHistogram setup_times;
+	for (size_t offset = alloc_stride; offset < 128 * one_tb && alloc_count < num_allocs; offset += alloc_stride)
+	{
+		const uint64_t start = GetTimeNs();
+		void* p = mmap(null_char + offset, alloc_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+		setup_times.Record(GetTimeNs() - start);
+		if (p == MAP_FAILED)
+			continue;
+		if (p != null_char + offset)
+		{
+			// Kernels before 4.17 treat MAP_FIXED_NOREPLACE as a hint.
+			munmap(p, alloc_size);
+			continue;
+		}
+		// Write a return instruction so that each block has a page of code, and
+		// the page tables to map it.
+		*static_cast<unsigned char*>(p) = 0xC3;
+		++alloc_count;
+	}
+	printf("Allocated %zd blocks of size %1.3f MiB with a stride of %1.3f MiB.\n",
+		alloc_count, alloc_size / double(one_mb), alloc_stride / double(one_mb));
+	setup_times.PrintSummary("setup mmap");
+	PrintAddressSpace("Ended", buffer.get());
+
+	// The scanner state is shared so that a scanner process can report back.
+	void* shared = mmap(nullptr, sizeof(scanner_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+	{
+		printf("Failed to allocate shared memory - errno is %d. Exiting.\n", errno);
+		return 1;
+	}
+	scanner_state* scanner = new (shared) scanner_state();
+	const int pid = getpid();
+	std::thread scanner_thread;
+	pid_t scanner_pid = 0;
+	if (strcmp(scanner_type, "thread") == 0)
+	{
+		scanner_thread = std::thread(ScannerLoop, pid, scan_file, slice_us, scanner);
+	}
+	else if (strcmp(scanner_type, "process") == 0)
+	{
+		scanner_pid = fork();
+		if (scanner_pid == 0)
+		{
+			// Exit when the parent does.
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			ScannerLoop(pid, scan_file, slice_us, scanner);
+			_exit(0);
+		}
+	}
+	else
+	{
+		scanner = nullptr;
+	}
+	if (arena_ops)
+	{
+		printf("Finished initialization. Comparing code allocators with scanner '%s' reading %s.\n\n",
+			scanner_type, scan_description);
+		fflush(stdout);
+		RunArenaComparison(arena_ops, buffer.get());
+	}
+	else if (wx_threads)
+	{
+		printf("Finished initialization. Comparing W^X patching with scanner '%s' reading %s.\n\n",
+			scanner_type, scan_description);
+		fflush(stdout);
+		RunPatchComparison(ParseThreadCounts(wx_threads), run_s ? run_s : 2);
+	}
+	else if (storm_threads)
+	{
+		printf("Finished initialization. Running storm with scanner '%s' reading %s.\n\n", scanner_type, scan_description);
+		fflush(stdout);
+		RunStorm(ParseThreadCounts(storm_threads), run_s ? run_s : 2);
+	}
+	if (arena_ops || wx_threads || storm_threads)
+	{
+		if (scanner)
+		{
+			scanner->scan_times.PrintSummary("scan");
+			scanner->stop = true;
+		}
+		if (scanner_thread.joinable())
+			scanner_thread.join();
+		if (scanner_pid > 0)
+			waitpid(scanner_pid, nullptr, 0);
+		return 0;
+	}
+
+	printf("Finished initialization. Sitting in mmap loop with scanner '%s' reading %s. Type Ctrl+C to exit.\n\n",
+		scanner_type, scan_description);
+	fflush(stdout);
+
+	// Sit in a loop where we sleep for a bit and then map and unmap a page of
+	// executable memory. While a scanner is reading our smaps, both calls wait
+	// for mmap_lock.
+	LatencyHistogram mmap_times;
+	LatencyHistogram munmap_times;
+	const uint64_t start_time = GetTimeNs();
+	uint64_t next_report = report_s ? start_time + report_s * 1000000000ull : UINT64_MAX;
+	for (;;)
+	{
+		if (interval_ms)
+			usleep(interval_ms * 1000);
+		uint64_t start = GetTimeNs();
+		void* p = mmap(nullptr, 4096, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		uint64_t mapped = GetTimeNs();
+		if (p != MAP_FAILED)
+			munmap(p, 4096);
+		uint64_t unmapped = GetTimeNs();
+		mmap_times.Record(mapped - start);
+		munmap_times.Record(unmapped - mapped);
+		if (unmapped - start > 500 * 1000000ull)
+		{
+			char time_text[10];
+			const time_t now = time(nullptr);
+			strftime(time_text, sizeof(time_text), "%H:%M:%S", localtime(&now));
+			printf("mmap+munmap took %1.3fs at %s.\n", (unmapped - start) / 1e9, time_text);
+		}
+		if (unmapped >= next_report)
+		{
+			PrintLatencies(mmap_times, munmap_times, scanner, (unmapped - start_time) / 1e9);
+			next_report += report_s * 1000000000ull;
+		}
+		if (run_s && unmapped - start_time >= run_s * 1000000000ull)
+			break;
+	}
+
+	PrintLatencies(mmap_times, munmap_times, scanner, (GetTimeNs() - start_time) / 1e9);
+	if (scanner)
+		scanner->stop = true;
+	if (scanner_thread.joinable())
+		scanner_thread.join();
+	if (scanner_pid > 0)
+		waitpid(scanner_pid, nullptr, 0);
+	return 0;
+}
@@ -0,0 +1,565 @@
+﻿// Fast, allocation-free readers for the Linux /proc files that describe a
+// process's address space: /proc/<pid>/maps, smaps, smaps_rollup and status.
+// The kernel generates these files as text while holding the target's
+// mmap_lock, so the reader pulls them in with a few large read() calls and
+// then parses the lines in place. Nothing is allocated per line or per
+// region, so scanning a process with 100k+ VMAs is dominated by the time the
+// kernel takes to format the text. RegionCursor instead reads maps in small
+// pieces, a slice at a time, for scanners that must not hold the lock for long.
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Hands out complete lines from a /proc file, using a caller-supplied buffer.
+// Lines that don't fit in the buffer are truncated to the buffer size.
+class ProcLineReader
+{
+public:
+	ProcLineReader(char* buffer, size_t buffer_size)
+		: buffer_(buffer), buffer_size_(buffer_size)
+	{
+	}
+	~ProcLineReader()
+	{
+		Close();
+	}
+	ProcLineReader(const ProcLineReader&) = delete;
+	ProcLineReader& operator=(const ProcLineReader&) = delete;
+
+	// Returns false, with errno set, if the file can't be opened.
+	bool Open(const char* path)
+	{
+		Close();
+		fd_ = open(path, O_RDONLY | O_CLOEXEC);
+		begin_ = end_ = 0;
+		eof_ = false;
+		skipping_ = false;
+		return fd_ >= 0;
+	}
+
+	void Close()
+	{
+		if (fd_ >= 0)
+			close(fd_);
+		fd_ = -1;
+	}
+
+	// Limits how much each read() asks for. The kernel holds the target's
+	// mmap_lock for the whole of each read of maps or smaps, so smaller reads
+	// mean shorter waits for the target, at the cost of more system calls.
+	void set_max_read(size_t max_read)
+	{
+		max_read_ = max_read;
+	}
+
+	// Returns false at the end of the file. The line is not null terminated and
+	// doesn't include the '\n', and it is only valid until the next call.
+	bool NextLine(const char** line, size_t* length)
+	{
+		for (;;)
+		{
+			const char* start = buffer_ + begin_;
+			const char* newline = static_cast<const char*>(memchr(start, '\n', end_ - begin_));
+			if (newline)
+			{
+				begin_ = newline + 1 - buffer_;
+				if (skipping_)
+				{
+					skipping_ = false;
+					continue;
+				}
+				*line = start;
+				*length = newline - start;
+				return true;
+			}
+			if (eof_)
+			{
+				// Last line without a trailing newline.
+				if (begin_ == end_ || skipping_)
+					return false;
+				*line = start;
+				*length = end_ - begin_;
+				begin_ = end_;
+				return true;
+			}
+			if (begin_ == 0 && end_ == buffer_size_)
+			{
+				// The line is longer than the buffer - return the start of it and
+				// throw the rest away.
+				begin_ = end_ = 0;
+				if (skipping_)
+					continue;
+				skipping_ = true;
+				*line = buffer_;
+				*length = buffer_size_;
+				return true;
+			}
+			// Move the partial line to the start of the buffer and read more.
+			memmove(buffer_, buffer_ + begin_, end_ - begin_);
+			end_ -= begin_;
+			begin_ = 0;
+			const size_t read_size = std::min(buffer_size_ - end_, max_read_);
+			ssize_t bytes_read = fd_ >= 0 ? read(fd_, buffer_ + end_, read_size) : 0;
+			if (bytes_read <= 0)
+				eof_ = true;
+			else
+				end_ += bytes_read;
+		}
+	}
+
+private:
+	char* buffer_;
+	size_t buffer_size_;
+	size_t begin_ = 0; // Start of the unconsumed data in buffer_.
+	size_t end_ = 0; // End of the valid data in buffer_.
+	size_t max_read_ = SIZE_MAX;
+	int fd_ = -1;
+	bool eof_ = false;
+	bool skipping_ = false; // Discarding the rest of a truncated line.
+};
+
+// Parsing helpers. Each one advances *p past what it consumed and never reads
+// past end.
+inline uint64_t ParseHex(const char** p, const char* end)
+{
+	uint64_t value = 0;
+	for (const char* s = *p; s < end; ++s)
+	{
+		unsigned digit;
+		if (*s >= '0' && *s <= '9')
+			digit = *s - '0';
+		else if (*s >= 'a' && *s <= 'f')
+			digit = *s - 'a' + 10;
+		else if (*s >= 'A' && *s <= 'F')
+			digit = *s - 'A' + 10;
+		else
+		{
+			*p = s;
+			return value;
+		}
+		value = value * 16 + digit;
+	}
+	*p = end;
+	return value;
+}
+
+inline uint64_t ParseDecimal(const char** p, const char* end)
+{
+	uint64_t value = 0;
+	const char* s = *p;
+	for (; s < end && *s >= '0' && *s <= '9'; ++s)
+		value = value * 10 + (*s - '0');
+	*p = s;
+	return value;
+}
+
+inline void SkipSpaces(const char** p, const char* end)
+{
+	while (*p < end && (**p == ' ' || **p == '\t'))
+		++*p;
+}
+
+// One line of /proc/<pid>/maps:
+//   start-end perms offset major:minor inode path
+struct MapsRegion
+{
+	uint64_t start;
+	uint64_t end;
+	bool read;
+	bool write;
+	bool exec;
+	bool shared;
+	uint64_t offset;
+	uint32_t dev_major;
+	uint32_t dev_minor;
+	uint64_t inode;
+	// Pathname, [heap], [stack], etc., or empty for anonymous memory. Not null
+	// terminated, and only valid until the next line is read.
+	const char* path;
+	size_t path_length;
+
+	uint64_t size() const { return end - start; }
+	// PROT_NONE regions are reservations - guard pages and address space that
+	// was mapped with the intent of committing it later.
+	bool accessible() const { return read || write || exec; }
+};
+
+inline bool ParseMapsLine(const char* line, size_t length, MapsRegion* region)
+{
+	const char* p = line;
+	const char* end = line + length;
+	region->start = ParseHex(&p, end);
+	if (p >= end || *p++ != '-')
+		return false;
+	region->end = ParseHex(&p, end);
+	SkipSpaces(&p, end);
+	if (end - p < 4)
+		return false;
+	region->read = p[0] == 'r';
+	region->write = p[1] == 'w';
+	region->exec = p[2] == 'x';
+	region->shared = p[3] == 's';
+	p += 4;
+	SkipSpaces(&p, end);
+	region->offset = ParseHex(&p, end);
+	SkipSpaces(&p, end);
+	region->dev_major = uint32_t(ParseHex(&p, end));
+	if (p >= end || *p++ != ':')
+		return false;
+	region->dev_minor = uint32_t(ParseHex(&p, end));
+	SkipSpaces(&p, end);
+	region->inode = ParseDecimal(&p, end);
+	SkipSpaces(&p, end);
+	region->path = p;
+	region->path_length = end - p;
+	return region->end >= region->start;
+}
+
+// Calls callback(const MapsRegion&) for each region of the process, in address
+// order. The callback returns false to stop early. Returns false, with errno
+// set, if the maps file couldn't be opened, which usually means the process
+// has exited or we lack ptrace access to it.
+template <typename Callback>
+bool ForEachMapsRegion(int pid, char* buffer, size_t buffer_size, Callback callback)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	ProcLineReader reader(buffer, buffer_size);
+	if (!reader.Open(path))
+		return false;
+	const char* line;
+	size_t length;
+	while (reader.NextLine(&line, &length))
+	{
+		MapsRegion region;
+		if (ParseMapsLine(line, length, &region) && !callback(region))
+			break;
+	}
+	return true;
+}
+
+// Walks the regions of /proc/<pid>/maps incrementally, so that a huge address
+// space can be scanned in short slices instead of in one go. Each Scan() yields
+// regions until a time or region budget runs out, and the next call carries on
+// with the following region. The file stays open between calls and each
+// read() is kept small, so the target's mmap_lock is only ever held for as
+// long as the kernel takes to format one read's worth of regions, and never
+// while the caller is doing something else.
+// If the address space changes between slices the kernel carries on from the
+// last address it formatted. Regions that end at or below position() are
+// skipped, so no region is yielded twice in one pass, but a region that has
+// grown downwards may start below the end of the previous one.
+class RegionCursor
+{
+public:
+	enum Status
+	{
+		kMore, // The budget ran out or the callback stopped the scan.
+		kDone, // The pass is complete. The next Scan() starts a new pass.
+		kFailed, // maps couldn't be opened, and errno is set.
+	};
+
+	// About 200 regions per read.
+	static constexpr size_t kDefaultMaxRead = 16 * 1024;
+
+	// buffer must be larger than max_read. Budgets are measured with clock -
+	// CLOCK_MONOTONIC for elapsed time or CLOCK_THREAD_CPUTIME_ID for the
+	// scanner's own CPU time.
+	RegionCursor(int pid, char* buffer, size_t buffer_size, size_t max_read = kDefaultMaxRead,
+		clockid_t clock = CLOCK_MONOTONIC)
+		: reader_(buffer, buffer_size), clock_(clock)
+	{
+		snprintf(path_, sizeof(path_), "/proc/%d/maps", pid);
+		reader_.set_max_read(max_read);
+	}
+
+	// Calls callback(const MapsRegion&) for each region, in address order,
+	// until the pass is complete, the callback returns false, max_regions
+	// regions have been yielded, or budget_ns has passed. Zero means no limit.
+	// The time is only checked every few regions, so it can overrun slightly.
+	template <typename Callback>
+	Status Scan(uint64_t budget_ns, size_t max_regions, Callback callback)
+	{
+		if (!open_)
+		{
+			if (!reader_.Open(path_))
+				return kFailed;
+			open_ = true;
+		}
+		const uint64_t start = budget_ns ? Now() : 0;
+		size_t regions = 0;
+		const char* line;
+		size_t length;
+		while (reader_.NextLine(&line, &length))
+		{
+			MapsRegion region;
+			if (!ParseMapsLine(line, length, &region) || region.end <= position_)
+				continue;
+			position_ = region.end;
+			++regions;
+			if (!callback(static_cast<const MapsRegion&>(region)))
+				return kMore;
+			if (max_regions && regions >= max_regions)
+				return kMore;
+			if (budget_ns && regions % kRegionsPerClockCheck == 0 && Now() - start >= budget_ns)
+				return kMore;
+		}
+		reader_.Close();
+		open_ = false;
+		position_ = 0;
+		++passes_;
+		return kDone;
+	}
+
+	// Abandons the pass in progress, and makes the next Scan() start with the
+	// first region that ends above address. maps can't be opened at an
+	// address, so the regions below it are read and skipped.
+	void Seek(uint64_t address)
+	{
+		reader_.Close();
+		open_ = false;
+		position_ = address;
+	}
+
+	// The end of the last region yielded in this pass.
+	uint64_t position() const { return position_; }
+	// The number of passes completed.
+	size_t passes() const { return passes_; }
+
+private:
+	// Reading a CPU-time clock is a system call, so it isn't done per region.
+	static constexpr size_t kRegionsPerClockCheck = 16;
+
+	uint64_t Now() const
+	{
+		timespec ts;
+		clock_gettime(clock_, &ts);
+		return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	}
+
+	ProcLineReader reader_;
+	char path_[64];
+	clockid_t clock_;
+	bool open_ = false;
+	uint64_t position_ = 0;
+	size_t passes_ = 0;
+};
+
+// Splits a "Name:   1234 kB" line, as found in smaps, smaps_rollup and status,
+// into the name and the value. Values with a kB suffix are returned in bytes.
+// Returns false for lines that aren't in this form.
+inline bool ParseProcField(const char* line, size_t length, const char** name, size_t* name_length, uint64_t* value)
+{
+	const char* end = line + length;
+	const char* colon = static_cast<const char*>(memchr(line, ':', length));
+	if (!colon)
+		return false;
+	*name = line;
+	*name_length = colon - line;
+	const char* p = colon + 1;
+	SkipSpaces(&p, end);
+	if (p == end || *p < '0' || *p > '9')
+		return false;
+	*value = ParseDecimal(&p, end);
+	SkipSpaces(&p, end);
+	if (end - p >= 2 && p[0] == 'k' && p[1] == 'B')
+		*value *= 1024;
+	return true;
+}
+
+inline bool FieldIs(const char* name, size_t name_length, const char* expected)
+{
+	return strlen(expected) == name_length && memcmp(name, expected, name_length) == 0;
+}
+
+// The interesting totals from /proc/<pid>/smaps_rollup, in bytes.
+struct SmapsRollup
+{
+	uint64_t rss = 0;
+	uint64_t pss = 0;
+	uint64_t private_clean = 0;
+	uint64_t private_dirty = 0;
+	uint64_t anonymous = 0;
+	uint64_t anon_huge_pages = 0;
+	uint64_t swap = 0;
+	uint64_t locked = 0;
+};
+
+// smaps_rollup needs Linux 4.14 or later. Returns false, with errno set, if it
+// can't be read.
+inline bool ReadSmapsRollup(int pid, char* buffer, size_t buffer_size, SmapsRollup* rollup)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+	ProcLineReader reader(buffer, buffer_size);
+	if (!reader.Open(path))
+		return false;
+	*rollup = {};
+	const char* line;
+	size_t length;
+	while (reader.NextLine(&line, &length))
+	{
+		const char* name;
+		size_t name_length;
+		uint64_t value;
+		if (!ParseProcField(line, length, &name, &name_length, &value))
+			continue;
+		if (FieldIs(name, name_length, "Rss"))
+			rollup->rss = value;
+		else if (FieldIs(name, name_length, "Pss"))
+			rollup->pss = value;
+		else if (FieldIs(name, name_length, "Private_Clean"))
+			rollup->private_clean = value;
+		else if (FieldIs(name, name_length, "Private_Dirty"))
+			rollup->private_dirty = value;
+		else if (FieldIs(name, name_length, "Anonymous"))
+			rollup->anonymous = value;
+		else if (FieldIs(name, name_length, "AnonHugePages"))
+			rollup->anon_huge_pages = value;
+		else if (FieldIs(name, name_length, "Swap"))
+			rollup->swap = value;
+		else if (FieldIs(name, name_length, "Locked"))
+			rollup->locked = value;
+	}
+	return true;
+}
+
+// Returns the value of one field from /proc/<pid>/status, such as "VmPTE" (the
+// kernel's own count of page-table bytes), or -1 if it can't be read.
+inline int64_t ReadStatusField(int pid, const char* field, char* buffer, size_t buffer_size)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	ProcLineReader reader(buffer, buffer_size);
+	if (!reader.Open(path))
+		return -1;
+	const char* line;
+	size_t length;
+	while (reader.NextLine(&line, &length))
+	{
+		const char* name;
+		size_t name_length;
+		uint64_t value;
+		if (ParseProcField(line, length, &name, &name_length, &value) && FieldIs(name, name_length, field))
+			return int64_t(value);
+	}
+	return -1;
+}
+
+// One region of /proc/<pid>/smaps - the maps line plus the per-region
+// counters that matter for page-table accounting, in bytes.
+struct SmapsRegion : MapsRegion
+{
+	uint64_t kernel_page_size = 4096; // 2 MiB or 1 GiB for hugetlbfs mappings.
+	uint64_t rss = 0;
+	uint64_t swap = 0;
+	// Parts of rss that are mapped with 2 MiB PMD entries (transparent huge
+	// pages) rather than 4 KiB PTEs.
+	uint64_t anon_huge_pages = 0;
+	uint64_t file_pmd_mapped = 0;
+	uint64_t shmem_pmd_mapped = 0;
+	// hugetlbfs memory is counted here rather than in rss.
+	uint64_t hugetlb = 0;
+	// path points here, since the line it came from is gone by the time the
+	// region is complete. Long paths are truncated.
+	char path_storage[256];
+
+	uint64_t pmd_mapped() const { return anon_huge_pages + file_pmd_mapped + shmem_pmd_mapped; }
+};
+
+// Calls callback(const SmapsRegion&) for each region of the process, in address
+// order, once all of the region's fields have been read. The callback returns
+// false to stop early. Returns false, with errno set, if smaps couldn't be
+// opened. smaps is far larger than maps, so this is several times slower.
+template <typename Callback>
+bool ForEachSmapsRegion(int pid, char* buffer, size_t buffer_size, Callback callback)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/smaps", pid);
+	ProcLineReader reader(buffer, buffer_size);
+	if (!reader.Open(path))
+		return false;
+	SmapsRegion region;
+	bool have_region = false;
+	const char* line;
+	size_t length;
+	while (reader.NextLine(&line, &length))
+	{
+		// Field names start with an upper-case letter that isn't followed by
+		// '-', so they never parse as a maps line.
+		MapsRegion header;
+		if (ParseMapsLine(line, length, &header))
+		{
+			if (have_region && !callback(static_cast<const SmapsRegion&>(region)))
+				return true;
+			region = SmapsRegion();
+			static_cast<MapsRegion&>(region) = header;
+			region.path_length = std::min(header.path_length, sizeof(region.path_storage) - 1);
+			memcpy(region.path_storage, header.path, region.path_length);
+			region.path_storage[region.path_length] = 0;
+			region.path = region.path_storage;
+			have_region = true;
+			continue;
+		}
+		const char* name;
+		size_t name_length;
+		uint64_t value;
+		if (!have_region || !ParseProcField(line, length, &name, &name_length, &value))
+			continue;
+		if (FieldIs(name, name_length, "KernelPageSize"))
+			region.kernel_page_size = value;
+		else if (FieldIs(name, name_length, "Rss"))
+			region.rss = value;
+		else if (FieldIs(name, name_length, "Swap"))
+			region.swap = value;
+		else if (FieldIs(name, name_length, "AnonHugePages"))
+			region.anon_huge_pages = value;
+		else if (FieldIs(name, name_length, "FilePmdMapped"))
+			region.file_pmd_mapped = value;
+		else if (FieldIs(name, name_length, "ShmemPmdMapped"))
+			region.shmem_pmd_mapped = value;
+		else if (FieldIs(name, name_length, "Shared_Hugetlb") || FieldIs(name, name_length, "Private_Hugetlb"))
+			region.hugetlb += value;
+	}
+	if (have_region)
+		callback(static_cast<const SmapsRegion&>(region));
+	return true;
+}
+
+// Bits in each 64-bit /proc/<pid>/pagemap entry. The PFN bits are zeroed for
+// readers without CAP_SYS_ADMIN, but these flags are always available.
+constexpr uint64_t kPagemapPresent = 1ull << 63;
+constexpr uint64_t kPagemapSwapped = 1ull << 62;
+
+// Returns true if the CPU and kernel are using 5-level paging (LA57). The
+// kernel clears the la57 flag in /proc/cpuinfo when it runs with 4 levels.
+inline bool La57Enabled(char* buffer, size_t buffer_size)
+{
+	ProcLineReader reader(buffer, buffer_size);
+	if (!reader.Open("/proc/cpuinfo"))
+		return false;
+	const char* line;
+	size_t length;
+	while (reader.NextLine(&line, &length))
+	{
+		if (length < 5 || memcmp(line, "flags", 5) != 0)
+			continue;
+		const char* end = line + length;
+		for (const char* p = line; end - p >= 5; ++p)
+		{
+			if (memcmp(p, " la57", 5) == 0 && (end - p == 5 || p[5] == ' '))
+				return true;
+		}
+		// Every CPU has the same flags.
+		return false;
+	}
+	return false;
+}
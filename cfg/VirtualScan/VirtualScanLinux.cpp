@@ -0,0 +1,944 @@
+﻿// Linux version of VirtualScan.cpp.
+// This program scans the virtual address space of the specified process or
+// processes, specified either as a PID(s) or process name(s), and produces the
+// same report as the Windows version - committed memory, region counts, code
+// regions and an estimate of the page-table pages needed - from
+// /proc/<pid>/maps. The estimate is then compared with the kernel's own
+// page-table count (VmPTE) and the resident totals from smaps_rollup.
+// Reading maps or smaps holds the target's mmap_lock, which blocks the target
+// from calling mmap, munmap or mprotect, so the scan time is reported just as
+// it is on Windows.
+// Processes that match a name are scanned in parallel on a pool of threads,
+// and the results are printed in PID order.
+// With -exact the page tables are also counted from the pages that are
+// actually present, using smaps and pagemap, with 2 MiB and 1 GiB mappings and
+// 5-level paging taken into account, and broken down by region class.
+// With -watch the processes are rescanned every interval and only the changes
+// are printed - regions added, removed or changed, and the change in
+// committed memory and fragmentation - while keeping the scanner's own CPU
+// time under a budget, so that it can be left running against production
+// processes.
+// With -frag each process also gets a fragmentation report, with warnings when
+// it is close to vm.max_map_count.
+//
+// Build with:
+//   g++ -O2 -std=c++17 -pthread -o VirtualScan VirtualScanLinux.cpp
+
+#include "ProcMaps.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// A fourth-level page table page can address 2 MiB of address space.
+constexpr uint64_t l4_range = 2 * 1024 * 1024; // 2 MiB (21 bits)
+// Each subsequent level can address 512 times as much address space. This stems
+// from the fact that in 64-bit mode a page table entry is 8 bytes so you can
+// fit 512 of them into a 4 KiB page.
+constexpr uint64_t l3_range = l4_range * 512; // 1 GiB (30 bits)
+constexpr uint64_t l2_range = l3_range * 512; // 512 GiB (39 bits)
+constexpr uint64_t l1_range = l2_range * 512; // 256 TiB (48 bits)
+
+// Settings from the command line.
+bool exact_mode = false; // Count present pages with smaps and pagemap.
+bool fragmentation_mode = false; // Report gaps, splits and the VMA limit.
+bool five_level_paging = false; // Set from /proc/cpuinfo or -levels.
+
+// Size of the per-thread buffer that /proc files are read into. Large reads
+// mean fewer trips through the kernel's seq_file code.
+constexpr size_t kReadBufferSize = 256 * 1024;
+
+// Structure to track statistics as we scan through memory.
+struct stats
+{
+	uint64_t commit = 0; // Bytes in accessible (not PROT_NONE) regions.
+	size_t blocks = 0; // Number of accessible regions (VMAs).
+	size_t page_table_pages = 0; // Number of 4-KB page-table pages needed.
+	size_t code_blocks = 0; // Number of executable regions.
+	double elapsed_s = 0; // Time taken to read and parse the maps file.
+};
+
+double GetTime()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Returns how many page-table pages of the given range are needed to cover
+// [start, end) that haven't been counted already. Regions arrive in address
+// order so only the most recently counted page (*cur_base) can overlap. This
+// gives the same answer as the Windows version's 2 MiB walk, but in constant
+// time per region, which matters for multi-TiB reservations.
+size_t CountNewTablePages(uint64_t start, uint64_t end, uint64_t range, uint64_t* cur_base)
+{
+	const uint64_t first = start & ~(range - 1);
+	const uint64_t last = (end - 1) & ~(range - 1);
+	size_t count = size_t((last - first) / range + 1);
+	if (first == *cur_base)
+		--count;
+	*cur_base = last;
+	return count;
+}
+
+// Paging structures, from the leaf page tables up. Each table page holds 512
+// entries so each level covers 512 times as much address space as the one
+// below it, and the l4_range..l1_range constants are the amounts covered by
+// one table page at each level.
+enum PageTableLevel
+{
+	kPte, // Maps 4 KiB pages.
+	kPmd, // Maps 2 MiB pages, or points to PTE tables.
+	kPud, // Maps 1 GiB pages, or points to PMD tables.
+	kP4d, // Only present with 5-level paging.
+};
+
+constexpr uint64_t table_range[] = { l4_range, l3_range, l2_range, l1_range };
+
+// Counts the page-table pages needed to map a set of pages that are fed to it
+// in address order.
+class PageTableCounter
+{
+public:
+	explicit PageTableCounter(bool five_level)
+		: levels_(five_level ? kP4d + 1 : kP4d)
+	{
+		for (uint64_t& base : cur_base_)
+			base = 1;
+	}
+
+	// Records that [start, end) is mapped by entries in tables at leaf_level -
+	// kPte for 4 KiB pages, kPmd for 2 MiB pages, kPud for 1 GiB pages - and
+	// returns how many new table pages that needed.
+	size_t Map(uint64_t start, uint64_t end, PageTableLevel leaf_level)
+	{
+		size_t count = 0;
+		for (int level = leaf_level; level < levels_; ++level)
+			count += CountNewTablePages(start, end, table_range[level], &cur_base_[level]);
+		return count;
+	}
+
+private:
+	int levels_;
+	uint64_t cur_base_[kP4d + 1];
+};
+
+// Classes of region that page-table overhead is reported for.
+enum RegionClass
+{
+	kClassCode,
+	kClassFile,
+	kClassAnon,
+	kClassStack,
+	kClassShared,
+	kClassHugetlb,
+	kClassCount
+};
+
+const char* const class_names[kClassCount] = { "code", "file", "anon", "stack", "shared", "hugetlb" };
+
+RegionClass ClassifyRegion(const SmapsRegion& region)
+{
+	if (region.kernel_page_size > 4096)
+		return kClassHugetlb;
+	if (region.exec)
+		return kClassCode;
+	if (region.shared)
+		return kClassShared;
+	if (region.path_length >= 6 && memcmp(region.path, "[stack", 6) == 0)
+		return kClassStack;
+	if (region.inode != 0)
+		return kClassFile;
+	return kClassAnon;
+}
+
+struct class_stats
+{
+	size_t regions = 0;
+	uint64_t mapped = 0;
+	uint64_t resident = 0;
+	uint64_t huge = 0; // Resident bytes mapped with 2 MiB or 1 GiB pages.
+	size_t page_table_pages = 0;
+};
+
+// Counts the page-table pages that the process's present (or swapped out)
+// pages need, and appends a per-class report to output. The table pages are
+// attributed to the class of the region that first needed them.
+void ScanProcessExact(int pid, char* buffer, size_t buffer_size, char* output, size_t output_size, int64_t vm_pte)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+	// Without pagemap we fall back to the smaps totals, which can't say where
+	// in a region the resident pages are.
+	const int pagemap = open(path, O_RDONLY | O_CLOEXEC);
+
+	PageTableCounter counter(five_level_paging);
+	class_stats classes[kClassCount];
+	uint64_t entries[l4_range / 4096];
+
+	const double start_time = GetTime();
+	bool opened = ForEachSmapsRegion(pid, buffer, buffer_size, [&](const SmapsRegion& region)
+	{
+		class_stats& stats = classes[ClassifyRegion(region)];
+		++stats.regions;
+		stats.mapped += region.size();
+		stats.resident += region.rss + region.hugetlb;
+		stats.huge += region.pmd_mapped() + region.hugetlb;
+		// Untouched regions need no page tables, however large they are.
+		if (region.rss + region.swap + region.hugetlb == 0)
+			return true;
+		if (region.kernel_page_size >= l3_range)
+		{
+			stats.page_table_pages += counter.Map(region.start, region.end, kPud);
+			return true;
+		}
+		if (region.kernel_page_size >= l4_range)
+		{
+			stats.page_table_pages += counter.Map(region.start, region.end, kPmd);
+			return true;
+		}
+		if (pagemap < 0)
+		{
+			// Assume the pages are spread over the whole region, which makes
+			// this an upper bound, unless the region is entirely huge pages.
+			PageTableLevel leaf = region.pmd_mapped() >= region.size() ? kPmd : kPte;
+			stats.page_table_pages += counter.Map(region.start, region.end, leaf);
+			if (leaf == kPmd)
+				stats.page_table_pages += size_t(region.anon_huge_pages / l4_range);
+			return true;
+		}
+
+		// Walk the region one PTE table's worth (2 MiB) at a time.
+		uint64_t anon_huge_budget = region.anon_huge_pages;
+		uint64_t file_huge_budget = region.file_pmd_mapped + region.shmem_pmd_mapped;
+		for (uint64_t block = region.start & ~(l4_range - 1); block < region.end; block += l4_range)
+		{
+			const uint64_t first = std::max(block, region.start);
+			const uint64_t last = std::min(block + l4_range, region.end);
+			const size_t count = size_t((last - first) / 4096);
+			const ssize_t bytes = pread(pagemap, entries, count * sizeof(entries[0]), first / 4096 * sizeof(entries[0]));
+			if (bytes != ssize_t(count * sizeof(entries[0])))
+			{
+				stats.page_table_pages += counter.Map(first, last, kPte);
+				continue;
+			}
+			size_t present = 0;
+			size_t used = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				present += (entries[i] & kPagemapPresent) != 0;
+				used += (entries[i] & (kPagemapPresent | kPagemapSwapped)) != 0;
+			}
+			if (used == 0)
+				continue;
+			// pagemap doesn't say whether a page is mapped by a PMD, so a fully
+			// present, aligned block is assumed to be a huge page for as long as
+			// the region's AnonHugePages/FilePmdMapped/ShmemPmdMapped total lasts.
+			if (present == l4_range / 4096 && anon_huge_budget >= l4_range)
+			{
+				// The kernel sets aside ("deposits") a PTE table for every
+				// anonymous huge page, so that it can split it without having to
+				// allocate, and VmPTE counts it.
+				anon_huge_budget -= l4_range;
+				stats.page_table_pages += counter.Map(first, last, kPmd) + 1;
+			}
+			else if (present == l4_range / 4096 && file_huge_budget >= l4_range)
+			{
+				file_huge_budget -= l4_range;
+				stats.page_table_pages += counter.Map(first, last, kPmd);
+			}
+			else
+			{
+				stats.page_table_pages += counter.Map(first, last, kPte);
+			}
+		}
+		return true;
+	});
+	const double elapsed = GetTime() - start_time;
+	if (pagemap >= 0)
+		close(pagemap);
+	if (!opened)
+	{
+		snprintf(output, output_size, "  Failed to open smaps - errno is %d (%s)\n", errno, strerror(errno));
+		return;
+	}
+
+	// The total includes the top-level page directory, which belongs to no
+	// region and which VmPTE doesn't count.
+	size_t total_pages = 1;
+	for (const class_stats& stats : classes)
+		total_pages += stats.page_table_pages;
+	const double mb = 1024 * 1024;
+	int length = snprintf(output, output_size,
+		"  Exact: %6.3fs, %7zu KiB page tables (%s, %d-level), VmPTE %zu KiB\n",
+		elapsed, total_pages * 4, pagemap >= 0 ? "pagemap" : "smaps only",
+		five_level_paging ? 5 : 4, size_t(vm_pte >= 0 ? vm_pte / 1024 : 0));
+	for (int i = 0; i < kClassCount; ++i)
+	{
+		const class_stats& stats = classes[i];
+		if (length < 0 || size_t(length) >= output_size)
+			return;
+		if (stats.regions == 0)
+			continue;
+		length += snprintf(output + length, output_size - length,
+			"    %-7s %6zu regions, %9.1f MiB mapped, %8.1f MiB resident, %8.1f MiB huge, %6zu KiB page tables\n",
+			class_names[i], stats.regions, stats.mapped / mb, stats.resident / mb, stats.huge / mb,
+			stats.page_table_pages * 4);
+	}
+}
+
+// Warn when a process has used this much of vm.max_map_count. Past the limit
+// mmap, mprotect and munmap (which can split a region) fail with ENOMEM.
+constexpr double kMapCountWarningFraction = 0.9;
+
+// Returns the kernel's limit on the number of VMAs per process, or 0.
+uint64_t GetMaxMapCount(char* buffer, size_t buffer_size)
+{
+	ProcLineReader reader(buffer, buffer_size);
+	if (!reader.Open("/proc/sys/vm/max_map_count"))
+		return 0;
+	const char* line;
+	size_t length;
+	if (!reader.NextLine(&line, &length))
+		return 0;
+	return ParseDecimal(&line, line + length);
+}
+
+// Writes a size such as 4K, 2M or 1G, for labelling power-of-two buckets.
+void FormatSize(uint64_t size, char* text, size_t text_size)
+{
+	const char* const suffixes[] = { "", "K", "M", "G", "T", "P" };
+	int suffix = 0;
+	while (size >= 1024 && size % 1024 == 0 && suffix < 5)
+	{
+		size /= 1024;
+		++suffix;
+	}
+	snprintf(text, text_size, "%llu%s", (unsigned long long)size, suffixes[suffix]);
+}
+
+// Appends the fragmentation report to output: how close the process is to
+// vm.max_map_count, the gaps between regions, neighbouring regions that the
+// kernel would have merged if their protections matched, and which mappings
+// account for the most regions.
+void ScanFragmentation(int pid, char* buffer, size_t buffer_size, char* output, size_t output_size)
+{
+	// User addresses end at 128 TiB, or 64 PiB with 5-level paging, and
+	// anything above that (the [vsyscall] page) isn't part of the layout.
+	const uint64_t user_top = five_level_paging ? 1ull << 56 : 1ull << 47;
+
+	size_t regions = 0;
+	uint64_t largest_gap = 0;
+	size_t gaps = 0;
+	// Gaps by size - bucket i holds gaps from 4 KiB << i up to twice that.
+	size_t gap_histogram[40] = {};
+	size_t protection_splits = 0;
+	size_t unmerged = 0;
+	std::unordered_map<std::string, size_t> sites;
+
+	// The previous region's path has to be copied since its line is gone.
+	MapsRegion previous = {};
+	char previous_path[256];
+	bool have_previous = false;
+	bool opened = ForEachMapsRegion(pid, buffer, buffer_size, [&](const MapsRegion& region)
+	{
+		if (region.start >= user_top)
+			return false;
+		++regions;
+		++sites[region.path_length ? std::string(region.path, region.path_length) : std::string("[anon]")];
+		if (have_previous && region.start > previous.end)
+		{
+			const uint64_t gap = region.start - previous.end;
+			++gaps;
+			largest_gap = std::max(largest_gap, gap);
+			size_t bucket = 0;
+			while (bucket + 1 < std::size(gap_histogram) && (4096ull << (bucket + 1)) <= gap)
+				++bucket;
+			++gap_histogram[bucket];
+		}
+		else if (have_previous)
+		{
+			// Adjacent regions of the same mapping that the kernel keeps separate.
+			// Anonymous memory can always merge, file mappings only if the file
+			// offsets continue.
+			const size_t path_length = std::min(region.path_length, sizeof(previous_path) - 1);
+			const bool same_mapping = region.inode == previous.inode && region.shared == previous.shared &&
+				path_length == previous.path_length && memcmp(region.path, previous_path, path_length) == 0 &&
+				(region.inode == 0 || region.offset == previous.offset + previous.size());
+			if (same_mapping)
+			{
+				if (region.read != previous.read || region.write != previous.write || region.exec != previous.exec)
+					++protection_splits;
+				else
+					++unmerged;
+			}
+		}
+		previous = region;
+		previous.path_length = std::min(region.path_length, sizeof(previous_path) - 1);
+		memcpy(previous_path, region.path, previous.path_length);
+		previous.path = previous_path;
+		have_previous = true;
+		return true;
+	});
+	if (!opened || regions == 0)
+		return;
+
+	const uint64_t max_map_count = GetMaxMapCount(buffer, buffer_size);
+	const double gb = 1024.0 * 1024 * 1024;
+	int length = snprintf(output, output_size,
+		"  Fragmentation: %zu VMAs (%.1f%% of vm.max_map_count %llu), largest gap %.1f GiB, %zu gaps, "
+		"%zu protection splits, %zu unmerged neighbours\n",
+		regions, max_map_count ? 100.0 * regions / max_map_count : 0.0, (unsigned long long)max_map_count,
+		largest_gap / gb, gaps, protection_splits, unmerged);
+
+	auto append = [&](const char* format, auto... args)
+	{
+		if (length >= 0 && size_t(length) < output_size)
+			length += snprintf(output + length, output_size - length, format, args...);
+	};
+	append("    Gap sizes:");
+	for (size_t i = 0; i < std::size(gap_histogram); ++i)
+	{
+		if (gap_histogram[i])
+		{
+			char size[16];
+			FormatSize(4096ull << i, size, sizeof(size));
+			append(" %s+:%zu", size, gap_histogram[i]);
+		}
+	}
+	append("\n");
+
+	// The mappings with the most regions are usually where the fragmentation
+	// comes from - a JIT, an allocator using guard pages, or a leak.
+	std::vector<std::pair<size_t, const std::string*>> top_sites;
+	for (const auto& site : sites)
+		top_sites.emplace_back(site.second, &site.first);
+	const size_t top_count = std::min<size_t>(top_sites.size(), 5);
+	std::partial_sort(top_sites.begin(), top_sites.begin() + top_count, top_sites.end(),
+		[](const auto& lhs, const auto& rhs) { return lhs.first > rhs.first; });
+	append("    Most regions:");
+	for (size_t i = 0; i < top_count; ++i)
+		append(" %zu %s%s", top_sites[i].first, top_sites[i].second->c_str(), i + 1 < top_count ? "," : "");
+	append("\n");
+
+	// Every mmap can add a region, and an mprotect or munmap in the middle of a
+	// region adds two, so warn well before the limit.
+	if (max_map_count && regions >= max_map_count * kMapCountWarningFraction)
+	{
+		append("  WARNING: process %d is using %zu of %llu VMAs - mmap, mprotect and munmap will start failing "
+			"with ENOMEM.\n", pid, regions, (unsigned long long)max_map_count);
+	}
+	if (largest_gap < 1ull << 30)
+		append("  WARNING: process %d has no free gap of 1 GiB or more - large mmaps will fail with ENOMEM.\n", pid);
+}
+
+// Scans one process, writing the report into output. Returns false if the
+// process couldn't be scanned.
+bool ScanProcess(int pid, char* buffer, size_t buffer_size, char* output, size_t output_size)
+{
+	stats scan_stats = {};
+
+	// Assume one level 1 page table page - this will cover the entire 48-bit
+	// address space range. As we scan we will calculate how many level 2, 3,
+	// and 4 page table pages are needed.
+	scan_stats.page_table_pages = 1;
+
+	// Track where the L4 to L2 page tables are currently pointing.
+	// Set these to an impossible "address" to start with.
+	uint64_t cur_base_l4 = 1;
+	uint64_t cur_base_l3 = 1;
+	uint64_t cur_base_l2 = 1;
+
+	const double start_time = GetTime();
+	bool opened = ForEachMapsRegion(pid, buffer, buffer_size, [&](const MapsRegion& region)
+	{
+		// PROT_NONE regions are address space reservations, the equivalent of
+		// MEM_RESERVE, and have no page tables until they are made accessible.
+		if (!region.accessible() || region.size() == 0)
+			return true;
+		scan_stats.commit += region.size();
+		scan_stats.page_table_pages += CountNewTablePages(region.start, region.end, l4_range, &cur_base_l4);
+		scan_stats.page_table_pages += CountNewTablePages(region.start, region.end, l3_range, &cur_base_l3);
+		scan_stats.page_table_pages += CountNewTablePages(region.start, region.end, l2_range, &cur_base_l2);
+		++scan_stats.blocks;
+		if (region.exec)
+			++scan_stats.code_blocks;
+		return true;
+	});
+	scan_stats.elapsed_s = GetTime() - start_time;
+	if (!opened)
+	{
+		snprintf(output, output_size, "Failed to open process %d - errno is %d (%s)\n", pid, errno, strerror(errno));
+		return false;
+	}
+	// A process that has exited, or a kernel thread, has an empty maps file.
+	if (scan_stats.blocks == 0)
+	{
+		snprintf(output, output_size, "No address space in process %d\n", pid);
+		return false;
+	}
+
+	scan_stats.commit += scan_stats.page_table_pages * 4096;
+	const double mb = 1024 * 1024;
+
+	const int64_t vm_pte = ReadStatusField(pid, "VmPTE", buffer, buffer_size);
+	int length = snprintf(output, output_size, "Total: %6.3fs, %5.1f MiB, %7.1f MiB, %6zd, %zd code blocks, in process %d\n",
+		scan_stats.elapsed_s, scan_stats.commit / mb,
+		scan_stats.page_table_pages / 256.0, scan_stats.blocks,
+		scan_stats.code_blocks, pid);
+	if (length < 0 || size_t(length) >= output_size)
+		return true;
+
+	// The kernel knows exactly how much page-table memory the process uses, so
+	// print that next to the estimate, along with what is actually resident.
+	SmapsRollup rollup;
+	if (ReadSmapsRollup(pid, buffer, buffer_size, &rollup))
+	{
+		snprintf(output + length, output_size - length,
+			"  Resident: %5.1f MiB, Pss %5.1f MiB, Anon %5.1f MiB, Swap %5.1f MiB, VmPTE %5.1f MiB\n",
+			rollup.rss / mb, rollup.pss / mb, rollup.anonymous / mb, rollup.swap / mb,
+			vm_pte >= 0 ? vm_pte / mb : 0.0);
+	}
+	if (exact_mode)
+	{
+		length = int(strlen(output));
+		ScanProcessExact(pid, buffer, buffer_size, output + length, output_size - length, vm_pte);
+	}
+	if (fragmentation_mode)
+	{
+		length = int(strlen(output));
+		ScanFragmentation(pid, buffer, buffer_size, output + length, output_size - length);
+	}
+	return true;
+}
+
+// Returns true if the process's executable name matches name. The name in
+// /proc/<pid>/comm is truncated to 15 characters so the executable's path is
+// checked when we have access to it.
+bool ProcessNameMatches(int pid, const char* name)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+	char exe[PATH_MAX];
+	ssize_t exe_length = readlink(path, exe, sizeof(exe) - 1);
+	if (exe_length > 0)
+	{
+		exe[exe_length] = 0;
+		// Deleted executables have " (deleted)" appended.
+		char* deleted = strstr(exe, " (deleted)");
+		if (deleted)
+			*deleted = 0;
+		const char* base = strrchr(exe, '/');
+		return strcmp(base ? base + 1 : exe, name) == 0;
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	char comm[32] = {};
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return false;
+	bool found = fgets(comm, sizeof(comm), file) != nullptr;
+	fclose(file);
+	if (!found)
+		return false;
+	comm[strcspn(comm, "\n")] = 0;
+	return strncmp(comm, name, 15) == 0 && (strlen(name) <= 15 || strlen(comm) == 15);
+}
+
+// Returns the PIDs of all processes whose names match name, or of all
+// processes if name is "*", in ascending order.
+std::vector<int> FindProcesses(const char* name)
+{
+	std::vector<int> pids;
+	DIR* proc = opendir("/proc");
+	if (!proc)
+		return pids;
+	while (dirent* entry = readdir(proc))
+	{
+		int pid = atoi(entry->d_name);
+		if (pid > 0 && (strcmp(name, "*") == 0 || ProcessNameMatches(pid, name)))
+			pids.push_back(pid);
+	}
+	closedir(proc);
+	// Scan the processes in a predictable order.
+	std::sort(pids.begin(), pids.end());
+	return pids;
+}
+
+// Scans the processes on thread_count threads and prints the results in the
+// order of pids.
+void ScanProcesses(const std::vector<int>& pids, unsigned thread_count)
+{
+	constexpr size_t output_size = 4096;
+	std::vector<char> outputs(pids.size() * output_size);
+	std::vector<char> succeeded(pids.size());
+	std::atomic<size_t> next_index(0);
+
+	auto worker = [&]()
+	{
+		std::unique_ptr<char[]> buffer(new char[kReadBufferSize]);
+		for (;;)
+		{
+			size_t i = next_index++;
+			if (i >= pids.size())
+				break;
+			succeeded[i] = ScanProcess(pids[i], buffer.get(), kReadBufferSize, &outputs[i * output_size], output_size);
+		}
+	};
+
+	thread_count = std::max(1u, std::min(thread_count, unsigned(pids.size())));
+	const double start_time = GetTime();
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < thread_count; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (auto& thread : threads)
+		thread.join();
+	const double elapsed = GetTime() - start_time;
+
+	size_t scanned = 0;
+	for (size_t i = 0; i < pids.size(); ++i)
+	{
+		// Processes that we couldn't open are expected when scanning by name
+		// without root, so only the successful scans are printed.
+		if (succeeded[i])
+		{
+			printf("%s", &outputs[i * output_size]);
+			++scanned;
+		}
+	}
+	printf("Scanned %zu of %zu processes in %.3f s on %u threads.\n", scanned, pids.size(), elapsed, thread_count);
+}
+
+// Returns the CPU time used by this thread, including the kernel time spent
+// generating /proc files for it.
+double GetThreadCpuTime()
+{
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// One region in a -watch snapshot. Paths are interned, since the same few
+// paths are repeated across thousands of regions.
+struct watched_region
+{
+	uint64_t start;
+	uint64_t end;
+	char perms[5]; // As printed in maps, e.g. "r-xp".
+	uint32_t path_index;
+};
+
+// Totals that are compared between -watch snapshots.
+struct watch_totals
+{
+	size_t regions = 0;
+	uint64_t commit = 0; // Bytes in accessible (not PROT_NONE) regions.
+	size_t gaps = 0; // Holes between regions - a measure of fragmentation.
+};
+
+// Watches one process for -watch. Each call to Step continues the scan with a
+// RegionCursor until it is finished or the CPU budget is used up, so one scan
+// of a huge address space can be spread over several intervals, and the
+// target is never blocked for longer than one small read. When a scan
+// completes it is compared with the previous one and only the differences are
+// printed.
+class ProcessWatcher
+{
+public:
+	explicit ProcessWatcher(int pid)
+		: pid_(pid), buffer_(new char[kReadBufferSize]),
+		cursor_(pid, buffer_.get(), kReadBufferSize, RegionCursor::kDefaultMaxRead, CLOCK_THREAD_CPUTIME_ID)
+	{
+	}
+
+	// Returns false once the process has gone away.
+	bool Step(double budget_s)
+	{
+		const double cpu_start = GetThreadCpuTime();
+		if (!scanning_)
+		{
+			scanning_ = true;
+			current_.clear();
+			scan_cpu_s_ = 0;
+			scan_steps_ = 0;
+		}
+		++scan_steps_;
+
+		// Zero would mean no limit, so always allow at least a microsecond.
+		const uint64_t budget_ns = std::max(uint64_t(budget_s * 1e9), uint64_t(1000));
+		const RegionCursor::Status status = cursor_.Scan(budget_ns, 0, [&](const MapsRegion& region)
+		{
+			watched_region watched = { region.start, region.end, {}, InternPath(region.path, region.path_length) };
+			watched.perms[0] = region.read ? 'r' : '-';
+			watched.perms[1] = region.write ? 'w' : '-';
+			watched.perms[2] = region.exec ? 'x' : '-';
+			watched.perms[3] = region.shared ? 's' : 'p';
+			current_.push_back(watched);
+			return true;
+		});
+		scan_cpu_s_ += GetThreadCpuTime() - cpu_start;
+		if (status == RegionCursor::kMore)
+			return true;
+		scanning_ = false;
+		if (status == RegionCursor::kFailed || current_.empty())
+		{
+			printf("Process %d has exited.\n", pid_);
+			return false;
+		}
+		Report();
+		previous_.swap(current_);
+		have_previous_ = true;
+		return true;
+	}
+
+private:
+	uint32_t InternPath(const char* path, size_t length)
+	{
+		std::string_view key(path, length);
+		auto it = path_indices_.find(key);
+		if (it != path_indices_.end())
+			return it->second;
+		paths_.emplace_back(path, length);
+		const uint32_t index = uint32_t(paths_.size() - 1);
+		path_indices_.emplace(paths_.back(), index);
+		return index;
+	}
+
+	static watch_totals GetTotals(const std::vector<watched_region>& regions)
+	{
+		watch_totals totals;
+		totals.regions = regions.size();
+		for (size_t i = 0; i < regions.size(); ++i)
+		{
+			if (regions[i].perms[0] != '-' || regions[i].perms[1] != '-' || regions[i].perms[2] != '-')
+				totals.commit += regions[i].end - regions[i].start;
+			if (i > 0 && regions[i].start > regions[i - 1].end)
+				++totals.gaps;
+		}
+		return totals;
+	}
+
+	void PrintRegion(char change, const watched_region& region)
+	{
+		printf("  %c %012llx-%012llx %s %10.1f KiB %s\n", change, (unsigned long long)region.start,
+			(unsigned long long)region.end, region.perms, (region.end - region.start) / 1024.0,
+			paths_[region.path_index].c_str());
+	}
+
+	void Report()
+	{
+		const watch_totals totals = GetTotals(current_);
+		char time[16];
+		const time_t now = ::time(nullptr);
+		strftime(time, sizeof(time), "%H:%M:%S", localtime(&now));
+		const double mb = 1024 * 1024;
+		if (!have_previous_)
+		{
+			printf("%s pid %d: %zu regions, %.1f MiB committed, %zu gaps, scan %.1f ms CPU in %zu step(s)\n",
+				time, pid_, totals.regions, totals.commit / mb, totals.gaps, scan_cpu_s_ * 1000, scan_steps_);
+			return;
+		}
+
+		// Both tables are in address order, so walk them together. A region that
+		// changes size or is split shows up as removed and added.
+		constexpr size_t max_printed = 20;
+		size_t added = 0;
+		size_t removed = 0;
+		size_t changed = 0;
+		std::vector<std::pair<char, const watched_region*>> changes;
+		size_t i = 0;
+		size_t j = 0;
+		while (i < previous_.size() || j < current_.size())
+		{
+			const watched_region* old_region = i < previous_.size() ? &previous_[i] : nullptr;
+			const watched_region* new_region = j < current_.size() ? &current_[j] : nullptr;
+			if (new_region && (!old_region || new_region->start < old_region->start ||
+				(new_region->start == old_region->start && new_region->end < old_region->end)))
+			{
+				changes.emplace_back('+', new_region);
+				++added;
+				++j;
+			}
+			else if (!new_region || old_region->start != new_region->start || old_region->end != new_region->end)
+			{
+				changes.emplace_back('-', old_region);
+				++removed;
+				++i;
+			}
+			else
+			{
+				if (memcmp(old_region->perms, new_region->perms, sizeof(old_region->perms)) != 0 ||
+					old_region->path_index != new_region->path_index)
+				{
+					changes.emplace_back('~', new_region);
+					++changed;
+				}
+				++i;
+				++j;
+			}
+		}
+		if (changes.empty())
+			return;
+
+		const watch_totals old_totals = GetTotals(previous_);
+		printf("%s pid %d: %zu regions (%+lld), %.1f MiB committed (%+.1f MiB), %zu gaps (%+lld), "
+			"%zu added, %zu removed, %zu changed, scan %.1f ms CPU in %zu step(s)\n",
+			time, pid_, totals.regions, (long long)totals.regions - (long long)old_totals.regions,
+			totals.commit / mb, ((double)totals.commit - (double)old_totals.commit) / mb,
+			totals.gaps, (long long)totals.gaps - (long long)old_totals.gaps,
+			added, removed, changed, scan_cpu_s_ * 1000, scan_steps_);
+		for (size_t k = 0; k < changes.size() && k < max_printed; ++k)
+			PrintRegion(changes[k].first, *changes[k].second);
+		if (changes.size() > max_printed)
+			printf("  ... and %zu more.\n", changes.size() - max_printed);
+	}
+
+	const int pid_;
+	std::unique_ptr<char[]> buffer_;
+	RegionCursor cursor_;
+	bool scanning_ = false;
+	double scan_cpu_s_ = 0; // CPU time spent on the scan in progress.
+	size_t scan_steps_ = 0; // How many intervals the scan in progress took.
+	std::vector<watched_region> current_;
+	std::vector<watched_region> previous_;
+	bool have_previous_ = false;
+	std::deque<std::string> paths_; // A deque so that the string_views stay valid.
+	std::unordered_map<std::string_view, uint32_t> path_indices_;
+};
+
+// Watches the processes until they have all exited, rescanning every
+// interval_ms and spending at most budget_ms of CPU time per interval.
+void WatchProcesses(const std::vector<int>& pids, unsigned interval_ms, unsigned budget_ms)
+{
+	std::vector<std::unique_ptr<ProcessWatcher>> watchers;
+	for (int pid : pids)
+		watchers.emplace_back(new ProcessWatcher(pid));
+	printf("Watching %zu process(es) every %u ms with a CPU budget of %u ms per interval. Type Ctrl+C to exit.\n",
+		watchers.size(), interval_ms, budget_ms);
+	while (!watchers.empty())
+	{
+		const double start_time = GetTime();
+		// Share the budget between the processes. Whatever one doesn't use is
+		// left for the next.
+		double budget_s = budget_ms / 1000.0;
+		for (size_t i = 0; i < watchers.size(); /**/)
+		{
+			const double cpu_start = GetThreadCpuTime();
+			const bool alive = watchers[i]->Step(budget_s / (watchers.size() - i));
+			budget_s = std::max(0.0, budget_s - (GetThreadCpuTime() - cpu_start));
+			if (alive)
+				++i;
+			else
+				watchers.erase(watchers.begin() + i);
+		}
+		fflush(stdout);
+		const double remaining_s = start_time + interval_ms / 1000.0 - GetTime();
+		if (remaining_s > 0)
+			std::this_thread::sleep_for(std::chrono::duration<double>(remaining_s));
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::unique_ptr<char[]> buffer(new char[kReadBufferSize]);
+	five_level_paging = La57Enabled(buffer.get(), kReadBufferSize);
+
+	unsigned thread_count = std::thread::hardware_concurrency();
+	unsigned watch_ms = 0;
+	unsigned budget_ms = 20;
+	int first_arg = 1;
+	for (; first_arg < argc && argv[first_arg][0] == '-'; ++first_arg)
+	{
+		// Accept --option as well as -option.
+		const char* option = argv[first_arg] + (argv[first_arg][1] == '-' ? 1 : 0);
+		if (strcmp(option, "-threads") == 0 && first_arg + 1 < argc)
+			thread_count = unsigned(atoi(argv[++first_arg]));
+		else if (strcmp(option, "-exact") == 0)
+			exact_mode = true;
+		else if (strcmp(option, "-frag") == 0)
+			fragmentation_mode = true;
+		else if (strcmp(option, "-levels") == 0 && first_arg + 1 < argc)
+			five_level_paging = atoi(argv[++first_arg]) == 5;
+		else if (strcmp(option, "-watch") == 0 && first_arg + 1 < argc)
+			watch_ms = unsigned(atoi(argv[++first_arg]));
+		else if (strcmp(option, "-budget") == 0 && first_arg + 1 < argc)
+			budget_ms = unsigned(atoi(argv[++first_arg]));
+		else
+			break;
+	}
+	if (argc <= first_arg)
+	{
+		printf("Specify a PID or process name, or * for all processes.\n");
+		printf("Usage: VirtualScan [-threads N] [-exact] [-frag] [-levels 4|5] [-watch ms [-budget ms]] pid|name|* ...\n");
+		printf("  -exact counts page tables from the pages that are present, using\n");
+		printf("         smaps and pagemap, and breaks them down by region class.\n");
+		printf("  -frag reports fragmentation - VMAs against vm.max_map_count, gaps,\n");
+		printf("         regions split only by protection and the mappings with the\n");
+		printf("         most regions - and warns before mmap fails with ENOMEM.\n");
+		printf("  -levels overrides the paging depth, which is normally read from\n");
+		printf("         /proc/cpuinfo.\n");
+		printf("  -watch rescans every ms milliseconds and prints only the changes,\n");
+		printf("         using at most -budget ms of CPU time per interval (default 20).\n");
+		return 0;
+	}
+
+	if (watch_ms)
+	{
+		std::vector<int> pids;
+		for (int arg = first_arg; arg < argc; ++arg)
+		{
+			// Sloppy but effective.
+			int pid = atoi(argv[arg]);
+			if (pid)
+			{
+				pids.push_back(pid);
+			}
+			else
+			{
+				std::vector<int> matches = FindProcesses(argv[arg]);
+				pids.insert(pids.end(), matches.begin(), matches.end());
+			}
+		}
+		WatchProcesses(pids, watch_ms, budget_ms);
+		return 0;
+	}
+
+	constexpr const char* header = "     Scan time, Committed, page tables, committed blocks\n";
+
+	for (int arg = first_arg; arg < argc; ++arg)
+	{
+		// Sloppy but effective.
+		int pid = atoi(argv[arg]);
+		if (pid)
+		{
+			printf("%s", header);
+			char output[4096];
+			ScanProcess(pid, buffer.get(), kReadBufferSize, output, sizeof(output));
+			printf("%s", output);
+		}
+		else
+		{
+			printf("Scanning all processes with names that match \"%s\"\n", argv[arg]);
+			printf("%s", header);
+			ScanProcesses(FindProcesses(argv[arg]), thread_count);
+		}
+	}
+	return 0;
+}